@@ -1,106 +1,326 @@
 #define OPCODENATOR_IMPLEMENTATION
 #include "../opcodenator.h"
 
+// Bits of the AVR status register, what OpcodeData.flags means here.
+#define FLAG_C (1 << 0)
+#define FLAG_Z (1 << 1)
+#define FLAG_N (1 << 2)
+#define FLAG_V (1 << 3)
+#define FLAG_S (1 << 4)
+#define FLAG_H (1 << 5)
+#define FLAG_T (1 << 6)
+#define FLAG_I (1 << 7)
+#define FLAGS_LOGIC (FLAG_Z | FLAG_N | FLAG_V | FLAG_S)
+#define FLAGS_ARITH (FLAGS_LOGIC | FLAG_C | FLAG_H)
+#define FLAGS_ALL   0xFF
+
+// cycles are the ones of the classic core, not counting taken branches and
+// skips. SPM takes as long as the flash does. The F bit of the INDIR_* opcodes
+// picks between a load and a store.
 OpcodeData simple_decode_opcodes[] = {
-  OPCODE("ADC",          "000111rdddddrrrr0000000000000000"),
-  OPCODE("ADD",          "000011rdddddrrrr0000000000000000"),
-  OPCODE("ADIW",         "10010110KKddKKKK0000000000000000"),
-  OPCODE("AND",          "001000rdddddrrrr0000000000000000"),
-  OPCODE("ANDI",         "0111KKKKddddKKKK0000000000000000"),
-  OPCODE("ASR",          "1001010ddddd01010000000000000000"),
-  OPCODE("BCLR",         "100101001sss10000000000000000000"),
-  OPCODE("BLD",          "1111100ddddd0bbb0000000000000000"),
-  OPCODE("BRBC",         "111101kkkkkkksss0000000000000000"),
-  OPCODE("BRBS",         "111100kkkkkkksss0000000000000000"),
-  OPCODE("BREAK",        "10010101100110000000000000000000"),
-  OPCODE("BSET",         "100101000sss10000000000000000000"),
-  OPCODE("BST",          "1111101ddddd0bbb0000000000000000"),
-  OPCODE("CALL",         "1001010kkkkk111kkkkkkkkkkkkkkkkk"),
-  OPCODE("COM",          "1001010ddddd00000000000000000000"),
-  OPCODE("CP",           "000101rdddddrrrr0000000000000000"),
-  OPCODE("CPC",          "000001rdddddrrrr0000000000000000"),
-  OPCODE("CPI",          "0011KKKKddddKKKK0000000000000000"),
-  OPCODE("CPSE",         "000100rdddddrrrr0000000000000000"),
-  OPCODE("DEC",          "1001010ddddd10100000000000000000"),
-  OPCODE("DES",          "10010100KKKK10110000000000000000"),
-  OPCODE("EICALL",       "10010101000110010000000000000000"),
-  OPCODE("EIJMP",        "10010100000110010000000000000000"),
-  OPCODE("EOR",          "001001rdddddrrrr0000000000000000"),
-  OPCODE("FMUL",         "000000110ddd1rrr0000000000000000"),
-  OPCODE("FMULS",        "000000111ddd0rrr0000000000000000"),
-  OPCODE("FMULSU",       "000000111ddd1rrr0000000000000000"),
-  OPCODE("ICALL",        "10010101000010010000000000000000"),
-  OPCODE("IJMP",         "10010100000010010000000000000000"),
-  OPCODE("IN",           "10110AAdddddAAAA0000000000000000"),
-  OPCODE("INC",          "1001010ddddd00110000000000000000"),
-  OPCODE("JMP",          "1001010kkkkk110kkkkkkkkkkkkkkkkk"),
-  OPCODE("LAC",          "1001001rrrrr01100000000000000000"),
-  OPCODE("LAS",          "1001001rrrrr01010000000000000000"),
-  OPCODE("LAT",          "1001001rrrrr01110000000000000000"),
-  OPCODE("INDIR_X",      "100100Fddddd11000000000000000000"),
-  OPCODE("INDIR_DP_D16", "10q0qqFdddddYqqq0000000000000000"),
-  OPCODE("INDIR_X_INC",  "100100Fddddd11010000000000000000"),
-  OPCODE("INDIR_X_DEC",  "100100Fddddd11100000000000000000"),
-  OPCODE("INDIR_Y_INC",  "100100Fddddd10010000000000000000"),
-  OPCODE("INDIR_Y_DEC",  "100100Fddddd10100000000000000000"),
-  OPCODE("INDIR_Z_INC",  "100100Fddddd00010000000000000000"),
-  OPCODE("INDIR_Z_DEC",  "100100Fddddd00100000000000000000"),
-  OPCODE("LDI",          "1110KKKKddddKKKK0000000000000000"),
-  OPCODE("LDS32",        "1001000ddddd0000kkkkkkkkkkkkkkkk"),
-  OPCODE("LPM_R0",       "10010101110e10000000000000000000"),
-  OPCODE("LPM",          "1001000ddddd01ei0000000000000000"),
-  OPCODE("LSR",          "1001010ddddd01100000000000000000"),
-  OPCODE("MOV",          "001011rdddddrrrr0000000000000000"),
-  OPCODE("MOVW",         "00000001ddddrrrr0000000000000000"),
-  OPCODE("MUL",          "100111rdddddrrrr0000000000000000"),
-  OPCODE("MULS",         "00000010ddddrrrr0000000000000000"),
-  OPCODE("MULSU",        "000000110ddd0rrr0000000000000000"),
-  OPCODE("NEG",          "1001010ddddd00010000000000000000"),
-  OPCODE("NOP",          "00000000000000000000000000000000"),
-  OPCODE("OR",           "001010rdddddrrrr0000000000000000"),
-  OPCODE("ORI",          "0110KKKKddddKKKK0000000000000000"),
-  OPCODE("OUT",          "10111AArrrrrAAAA0000000000000000"),
-  OPCODE("POP",          "1001000ddddd11110000000000000000"),
-  OPCODE("PUSH",         "1001001ddddd11110000000000000000"),
-  OPCODE("RCALL",        "1101kkkkkkkkkkkk0000000000000000"),
-  OPCODE("RET",          "10010101000010000000000000000000"),
-  OPCODE("RETI",         "10010101000110000000000000000000"),
-  OPCODE("RJMP",         "1100kkkkkkkkkkkk0000000000000000"),
-  OPCODE("ROR",          "1001010ddddd01110000000000000000"),
-  OPCODE("SBC",          "000010rdddddrrrr0000000000000000"),
-  OPCODE("SBCI",         "0100KKKKddddKKKK0000000000000000"),
-  OPCODE("SBI_CBI",      "100110F0AAAAAbbb0000000000000000"),
-  OPCODE("SBIC_SBIS",    "100110F1AAAAAbbb0000000000000000"),
-  OPCODE("SBIW",         "10010111KKddKKKK0000000000000000"),
-  OPCODE("SBRC_SBRS",    "111111Frrrrr0bbb0000000000000000"),
-  OPCODE("SLEEP",        "10010101100010000000000000000000"),
-  OPCODE("SPM",          "10010101111i10000000000000000000"),
-  OPCODE("STS32",        "1001001ddddd0000kkkkkkkkkkkkkkkk"),
-  OPCODE("SUB",          "000110rdddddrrrr0000000000000000"),
-  OPCODE("SUBI",         "0101KKKKddddKKKK0000000000000000"),
-  OPCODE("SWAP",         "1001010ddddd00100000000000000000"),
-  OPCODE("WDR",          "10010101101010000000000000000000"),
-  OPCODE("XCH",          "1001001rrrrr01000000000000000000"),
+  OPCODE("ADC",          "000111rdddddrrrr0000000000000000", .cycles = 1, .flags = FLAGS_ARITH),
+  OPCODE("ADD",          "000011rdddddrrrr0000000000000000", .cycles = 1, .flags = FLAGS_ARITH),
+  OPCODE("ADIW",         "10010110KKddKKKK0000000000000000", .cycles = 2, .flags = FLAGS_LOGIC | FLAG_C),
+  OPCODE("AND",          "001000rdddddrrrr0000000000000000", .cycles = 1, .flags = FLAGS_LOGIC),
+  OPCODE("ANDI",         "0111KKKKddddKKKK0000000000000000", .cycles = 1, .flags = FLAGS_LOGIC),
+  OPCODE("ASR",          "1001010ddddd01010000000000000000", .cycles = 1, .flags = FLAGS_LOGIC | FLAG_C),
+  OPCODE("BCLR",         "100101001sss10000000000000000000", .cycles = 1, .flags = FLAGS_ALL),
+  OPCODE("BLD",          "1111100ddddd0bbb0000000000000000", .cycles = 1),
+  OPCODE("BRBC",         "111101kkkkkkksss0000000000000000", .flow = FLOW_BRANCH, .cycles = 1),
+  OPCODE("BRBS",         "111100kkkkkkksss0000000000000000", .flow = FLOW_BRANCH, .cycles = 1),
+  OPCODE("BREAK",        "10010101100110000000000000000000", .cycles = 1),
+  OPCODE("BSET",         "100101000sss10000000000000000000", .cycles = 1, .flags = FLAGS_ALL),
+  OPCODE("BST",          "1111101ddddd0bbb0000000000000000", .cycles = 1, .flags = FLAG_T),
+  OPCODE("CALL",         "1001010kkkkk111kkkkkkkkkkkkkkkkk", .flow = FLOW_CALL, .length = 2, .cycles = 4),
+  OPCODE("COM",          "1001010ddddd00000000000000000000", .cycles = 1, .flags = FLAGS_LOGIC | FLAG_C),
+  OPCODE("CP",           "000101rdddddrrrr0000000000000000", .cycles = 1, .flags = FLAGS_ARITH),
+  OPCODE("CPC",          "000001rdddddrrrr0000000000000000", .cycles = 1, .flags = FLAGS_ARITH),
+  OPCODE("CPI",          "0011KKKKddddKKKK0000000000000000", .cycles = 1, .flags = FLAGS_ARITH),
+  OPCODE("CPSE",         "000100rdddddrrrr0000000000000000", .flow = FLOW_SKIP, .cycles = 1),
+  OPCODE("DEC",          "1001010ddddd10100000000000000000", .cycles = 1, .flags = FLAGS_LOGIC),
+  OPCODE("DES",          "10010100KKKK10110000000000000000", .cycles = 1, .flags = FLAG_H),
+  OPCODE("EICALL",       "10010101000110010000000000000000", .flow = FLOW_CALL, .cycles = 4),
+  OPCODE("EIJMP",        "10010100000110010000000000000000", .flow = FLOW_BRANCH, .cycles = 2),
+  OPCODE("EOR",          "001001rdddddrrrr0000000000000000", .cycles = 1, .flags = FLAGS_LOGIC),
+  OPCODE("FMUL",         "000000110ddd1rrr0000000000000000", .cycles = 2, .flags = FLAG_Z | FLAG_C),
+  OPCODE("FMULS",        "000000111ddd0rrr0000000000000000", .cycles = 2, .flags = FLAG_Z | FLAG_C),
+  OPCODE("FMULSU",       "000000111ddd1rrr0000000000000000", .cycles = 2, .flags = FLAG_Z | FLAG_C),
+  OPCODE("ICALL",        "10010101000010010000000000000000", .flow = FLOW_CALL, .cycles = 3),
+  OPCODE("IJMP",         "10010100000010010000000000000000", .flow = FLOW_BRANCH, .cycles = 2),
+  OPCODE("IN",           "10110AAdddddAAAA0000000000000000", .cycles = 1),
+  OPCODE("INC",          "1001010ddddd00110000000000000000", .cycles = 1, .flags = FLAGS_LOGIC),
+  OPCODE("JMP",          "1001010kkkkk110kkkkkkkkkkkkkkkkk", .flow = FLOW_BRANCH, .length = 2, .cycles = 3),
+  OPCODE("LAC",          "1001001rrrrr01100000000000000000", .memory = MEMORY_READ_WRITE, .cycles = 2),
+  OPCODE("LAS",          "1001001rrrrr01010000000000000000", .memory = MEMORY_READ_WRITE, .cycles = 2),
+  OPCODE("LAT",          "1001001rrrrr01110000000000000000", .memory = MEMORY_READ_WRITE, .cycles = 2),
+  OPCODE("INDIR_X",      "100100Fddddd11000000000000000000", .memory = MEMORY_READ_WRITE, .cycles = 2),
+  OPCODE("INDIR_DP_D16", "10q0qqFdddddYqqq0000000000000000", .memory = MEMORY_READ_WRITE, .cycles = 2),
+  OPCODE("INDIR_X_INC",  "100100Fddddd11010000000000000000", .memory = MEMORY_READ_WRITE, .cycles = 2),
+  OPCODE("INDIR_X_DEC",  "100100Fddddd11100000000000000000", .memory = MEMORY_READ_WRITE, .cycles = 2),
+  OPCODE("INDIR_Y_INC",  "100100Fddddd10010000000000000000", .memory = MEMORY_READ_WRITE, .cycles = 2),
+  OPCODE("INDIR_Y_DEC",  "100100Fddddd10100000000000000000", .memory = MEMORY_READ_WRITE, .cycles = 2),
+  OPCODE("INDIR_Z_INC",  "100100Fddddd00010000000000000000", .memory = MEMORY_READ_WRITE, .cycles = 2),
+  OPCODE("INDIR_Z_DEC",  "100100Fddddd00100000000000000000", .memory = MEMORY_READ_WRITE, .cycles = 2),
+  OPCODE("LDI",          "1110KKKKddddKKKK0000000000000000", .cycles = 1),
+  OPCODE("LDS32",        "1001000ddddd0000kkkkkkkkkkkkkkkk", .length = 2, .memory = MEMORY_READ, .cycles = 2),
+  OPCODE("LPM_R0",       "10010101110e10000000000000000000", .memory = MEMORY_PROGRAM, .cycles = 3),
+  OPCODE("LPM",          "1001000ddddd01ei0000000000000000", .memory = MEMORY_PROGRAM, .cycles = 3),
+  OPCODE("LSR",          "1001010ddddd01100000000000000000", .cycles = 1, .flags = FLAGS_LOGIC | FLAG_C),
+  OPCODE("MOV",          "001011rdddddrrrr0000000000000000", .cycles = 1),
+  OPCODE("MOVW",         "00000001ddddrrrr0000000000000000", .cycles = 1),
+  OPCODE("MUL",          "100111rdddddrrrr0000000000000000", .cycles = 2, .flags = FLAG_Z | FLAG_C),
+  OPCODE("MULS",         "00000010ddddrrrr0000000000000000", .cycles = 2, .flags = FLAG_Z | FLAG_C),
+  OPCODE("MULSU",        "000000110ddd0rrr0000000000000000", .cycles = 2, .flags = FLAG_Z | FLAG_C),
+  OPCODE("NEG",          "1001010ddddd00010000000000000000", .cycles = 1, .flags = FLAGS_ARITH),
+  OPCODE("NOP",          "00000000000000000000000000000000", .cycles = 1),
+  OPCODE("OR",           "001010rdddddrrrr0000000000000000", .cycles = 1, .flags = FLAGS_LOGIC),
+  OPCODE("ORI",          "0110KKKKddddKKKK0000000000000000", .cycles = 1, .flags = FLAGS_LOGIC),
+  OPCODE("OUT",          "10111AArrrrrAAAA0000000000000000", .cycles = 1),
+  OPCODE("POP",          "1001000ddddd11110000000000000000", .memory = MEMORY_READ, .cycles = 2),
+  OPCODE("PUSH",         "1001001ddddd11110000000000000000", .memory = MEMORY_WRITE, .cycles = 2),
+  OPCODE("RCALL",        "1101kkkkkkkkkkkk0000000000000000", .flow = FLOW_CALL, .cycles = 3),
+  OPCODE("RET",          "10010101000010000000000000000000", .flow = FLOW_RETURN, .cycles = 4),
+  OPCODE("RETI",         "10010101000110000000000000000000", .flow = FLOW_RETURN, .cycles = 4, .flags = FLAG_I),
+  OPCODE("RJMP",         "1100kkkkkkkkkkkk0000000000000000", .flow = FLOW_BRANCH, .cycles = 2),
+  OPCODE("ROR",          "1001010ddddd01110000000000000000", .cycles = 1, .flags = FLAGS_LOGIC | FLAG_C),
+  OPCODE("SBC",          "000010rdddddrrrr0000000000000000", .cycles = 1, .flags = FLAGS_ARITH),
+  OPCODE("SBCI",         "0100KKKKddddKKKK0000000000000000", .cycles = 1, .flags = FLAGS_ARITH),
+  OPCODE("SBI_CBI",      "100110F0AAAAAbbb0000000000000000", .cycles = 2),
+  OPCODE("SBIC_SBIS",    "100110F1AAAAAbbb0000000000000000", .flow = FLOW_SKIP, .cycles = 1),
+  OPCODE("SBIW",         "10010111KKddKKKK0000000000000000", .cycles = 2, .flags = FLAGS_LOGIC | FLAG_C),
+  OPCODE("SBRC_SBRS",    "111111Frrrrr0bbb0000000000000000", .flow = FLOW_SKIP, .cycles = 1),
+  OPCODE("SLEEP",        "10010101100010000000000000000000", .cycles = 1),
+  OPCODE("SPM",          "10010101111i10000000000000000000", .memory = MEMORY_PROGRAM),
+  OPCODE("STS32",        "1001001ddddd0000kkkkkkkkkkkkkkkk", .length = 2, .memory = MEMORY_WRITE, .cycles = 2),
+  OPCODE("SUB",          "000110rdddddrrrr0000000000000000", .cycles = 1, .flags = FLAGS_ARITH),
+  OPCODE("SUBI",         "0101KKKKddddKKKK0000000000000000", .cycles = 1, .flags = FLAGS_ARITH),
+  OPCODE("SWAP",         "1001010ddddd00100000000000000000", .cycles = 1),
+  OPCODE("WDR",          "10010101101010000000000000000000", .cycles = 1),
+  OPCODE("XCH",          "1001001rrrrr01000000000000000000", .memory = MEMORY_READ_WRITE, .cycles = 2),
 };
 static const uint16_t size = sizeof(simple_decode_opcodes) /
   sizeof(simple_decode_opcodes[0]);
 
-int main(void) {
+// Types and prototypes, everything that goes in a header.
+void print_declarations(OpcodenatorData d, const OpcodePair *pairs,
+    uint32_t pairs_size) {
+  print_includes(d);
+  fprintf(d.stream, "\n");
+  print_enum_declaration(d);
+  fprintf(d.stream, "\n");
+  print_struct_declaration(d);
+  fprintf(d.stream, "\n");
+  print_metadata_declaration(d);
+  fprintf(d.stream, "\n");
+  print_function_declarations(d);
+  fprintf(d.stream, "\n");
+  print_array_declaration(d);
+  print_decoder_declaration(d);
+  fprintf(d.stream, "\n");
+  print_fetch_declarations(d);
+  fprintf(d.stream, "\n");
+  print_block_cache_declarations(d);
+  fprintf(d.stream, "\n");
+  print_predecode_declarations(d);
+  fprintf(d.stream, "\n");
+  print_stream_declarations(d);
+  fprintf(d.stream, "\n");
+  print_fused_enum_declaration(d, pairs, pairs_size);
+  fprintf(d.stream, "\n");
+  print_fused_struct_declaration(d);
+  fprintf(d.stream, "\n");
+  print_fused_function_declarations(d, pairs, pairs_size);
+  fprintf(d.stream, "\n");
+  print_fused_decoder_declaration(d);
+}
+
+// Everything print_declarations() declares. With blob set the decoder tables
+// are only declared, they are expected to be written with
+// write_decoder_blob().
+void print_definitions(OpcodenatorData d, DecoderVariant variant, bool blob,
+    const OpcodePair *pairs, uint32_t pairs_size) {
+  print_empty_function_definitions(d);
+  fprintf(d.stream, "\n");
+  print_array_definition(d);
+  fprintf(d.stream, "\n");
+  print_metadata_definition(d);
+  fprintf(d.stream, "\n");
+  if (blob) {
+    print_decoder_blob_variant(d, variant);
+  } else {
+    print_decoder_variant(d, variant);
+  }
+  fprintf(d.stream, "\n");
+  print_pointer_decoder_function(d, 16);
+  fprintf(d.stream, "\n");
+  print_fetch_function(d, 16);
+  fprintf(d.stream, "\n");
+  print_block_cache(d, 16);
+  fprintf(d.stream, "\n");
+  print_predecode_cache(d, 16);
+  fprintf(d.stream, "\n");
+  print_stream_decoder(d, 16);
+  fprintf(d.stream, "\n");
+  print_fused_empty_function_definitions(d, pairs, pairs_size);
+  fprintf(d.stream, "\n");
+  print_fused_array_definition(d, pairs, pairs_size);
+  fprintf(d.stream, "\n");
+  print_fused_decoder_function(d, pairs, pairs_size);
+}
+
+FILE *open_output(const char *name, const char *extension, const char *mode) {
+  ShortString path = shortf("%s%s", name, extension);
+  FILE *f = fopen(path.val, mode);
+  if (f == NULL) {
+    fprintf(stderr, "can't open %s\n", path.val);
+    exit(1);
+  }
+
+  return f;
+}
+
+// Header guard for <name>.h, name upper cased with anything but letters and
+// digits turned into underscores.
+ShortString get_header_guard(const char *name) {
+  ShortString guard = shortf("%s_H", name);
+  for (int i = 0; i < guard.len; i++) {
+    guard.val[i] = isalnum((unsigned char)guard.val[i]) ?
+      toupper((unsigned char)guard.val[i]) : '_';
+  }
+
+  return guard;
+}
+
+// With only a backend the whole decoder is printed to stdout as a single
+// header. Given an output name it's split into <name>.h and <name>.c, and the
+// tables of every backend but switch go in <name>_tables.bin with
+// <name>_tables.S to assemble them, - prints to stdout. The autotune backend
+// benchmarks the others and uses the fastest, on the opcodes in an optional
+// workload file read by read_workload() or else on a sample of every opcode.
+int main(int argc, char **argv) {
+  const char *backend = argc > 1 ? argv[1] : "switch";
+  const char *output = argc > 2 && strcmp(argv[2], "-") != 0 ? argv[2] : NULL;
+  const char *workload_path = argc > 3 ? argv[3] : NULL;
+
   OpcodenatorData opcodenator = init_opcodenator(simple_decode_opcodes,
       size, "  ", "op_", "opcode_decode");
-  
-  print_includes();
-  printf("\n");
-  print_enum_declaration(opcodenator);
-  printf("\n");
-  print_struct_declaration(opcodenator);
-  printf("\n");
-  print_function_declarations(opcodenator);
-  printf("\n");
-  print_empty_function_definitions(opcodenator);
-  printf("\n");
-  print_array_definition(opcodenator);
-  printf("\n");
-  print_decoder_function(opcodenator);
+  opcodenator.profile = true;
+
+  DecoderBenchmark benchmarks[] = {
+    { .variant = { BACKEND_SWITCH, 0 } },
+    { .variant = { BACKEND_BRANCHLESS, 0 } },
+    { .variant = { BACKEND_PERFECT_HASH, 0 } },
+    { .variant = { BACKEND_TABLE, 8 } },
+    { .variant = { BACKEND_TABLE, 12 } },
+    { .variant = { BACKEND_TABLE, 16 } },
+  };
+  uint32_t benchmarks_size = sizeof(benchmarks) / sizeof(benchmarks[0]);
+  bool autotune = strcmp(backend, "autotune") == 0;
+  if (strcmp(backend, "table") == 0)
+    backend = "table_12";
+  uint32_t best = benchmarks_size;
+  for (uint32_t i = 0; i < benchmarks_size; i++) {
+    if (strcmp(backend, get_variant_name(opcodenator,
+        benchmarks[i].variant).val) == 0)
+      best = i;
+  }
+  if (best == benchmarks_size && !autotune) {
+    fprintf(stderr, "unknown backend: %s\n", backend);
+    return 1;
+  }
+  if (workload_path != NULL && !autotune) {
+    fprintf(stderr, "a workload is only used by autotune\n");
+    return 1;
+  }
+  if (autotune) {
+    size_t workload_size = 0;
+    uint64_t *workload = workload_path != NULL ?
+      read_workload(workload_path, &workload_size) : NULL;
+    best = autotune_decoder(opcodenator, benchmarks, benchmarks_size, workload,
+        workload_size);
+    free(workload);
+  }
+  DecoderVariant variant = benchmarks[best].variant;
+
+  // Made up execution trace, in practice it comes from running the decoder
+  // over a program. Every pair is followed by a word that didn't decode,
+  // which get_hot_pairs() leaves out.
+  static const struct {
+    const char *first;
+    const char *second;
+    uint32_t repeat;
+  } trace_pairs[] = {
+    { "CP",  "BRBS", 91 },
+    { "CPC", "BRBC", 42 },
+    { "LDI", "LDI",  83 },
+    { "CP",  "BRBC", 77 },
+    { "CPC", "BRBS", 42 },
+    { "MOV", "RET",   1 },
+  };
+  uint16_t trace[(91 + 42 + 83 + 77 + 42 + 1) * 3];
+  size_t trace_size = 0;
+  for (size_t i = 0; i < sizeof(trace_pairs) / sizeof(trace_pairs[0]); i++) {
+    for (uint32_t j = 0; j < trace_pairs[i].repeat; j++) {
+      trace[trace_size++] = get_opcode_index(opcodenator,
+          trace_pairs[i].first);
+      trace[trace_size++] = get_opcode_index(opcodenator,
+          trace_pairs[i].second);
+      trace[trace_size++] = opcodenator.size;
+    }
+  }
+  assert(trace_size == sizeof(trace) / sizeof(trace[0]));
+
+  OpcodePair pairs[sizeof(trace) / sizeof(trace[0])];
+  uint32_t pairs_size = get_pairs_from_trace(trace, trace_size, pairs);
+  // MOV RET only ran once, not worth a fused handler.
+  pairs_size = get_hot_pairs(opcodenator, pairs, pairs_size, 5, 2);
+
+  if (output == NULL) {
+    if (autotune) {
+      print_autotune_report(opcodenator, benchmarks, benchmarks_size, best);
+      printf("\n");
+    }
+    print_declarations(opcodenator, pairs, pairs_size);
+    printf("\n");
+    print_definitions(opcodenator, variant, false, pairs, pairs_size);
+    return 0;
+  }
+
+  const char *output_base = strrchr(output, '/') ? strrchr(output, '/') + 1 :
+    output;
+  // The Makefile can't know what autotune picks, so only an explicit
+  // backend with tables gets them assembled from a blob.
+  bool blob = !autotune && variant_has_blob(variant);
+
+  opcodenator.stream = open_output(output, ".h", "w");
+  if (autotune) {
+    print_autotune_report(opcodenator, benchmarks, benchmarks_size, best);
+    fprintf(opcodenator.stream, "\n");
+  }
+  ShortString guard = get_header_guard(output_base);
+  fprintf(opcodenator.stream, "#ifndef %s\n", guard.val);
+  fprintf(opcodenator.stream, "#define %s\n\n", guard.val);
+  print_declarations(opcodenator, pairs, pairs_size);
+  fprintf(opcodenator.stream, "\n#endif // %s\n", guard.val);
+  fclose(opcodenator.stream);
+
+  opcodenator.stream = open_output(output, ".c", "w");
+  fprintf(opcodenator.stream, "#include \"%s.h\"\n\n", output_base);
+  print_definitions(opcodenator, variant, blob, pairs, pairs_size);
+  fclose(opcodenator.stream);
+
+  if (blob) {
+    FILE *tables = open_output(output, "_tables.bin", "wb");
+    write_decoder_blob(opcodenator, variant, tables);
+    fclose(tables);
+
+    // Only the file name, the blob sits next to the .S so it's assembled with
+    // -Wa,-I<that directory>.
+    opcodenator.stream = open_output(output, "_tables.S", "w");
+    print_decoder_blob_assembly(opcodenator, variant,
+        shortf("%s_tables.bin", output_base).val);
+    fclose(opcodenator.stream);
+  }
+
   return 0;
 }
@@ -0,0 +1,124 @@
+#define OPCODENATOR_IMPLEMENTATION
+#include "../opcodenator.h"
+
+// Made up ISAs with opcodes exactly as wide as a uint64_t and wider than one,
+// made of 32 bit words. The fixed bits sit at both ends of the opcodes and
+// BUNDLE's cross from one 64 bit lane to the other.
+OpcodeData wide_64_opcodes[] = {
+  OPCODE("NOP",    "00000000000000000000000000000000"
+                   "00000000000000000000000000000000", .cycles = 1),
+  OPCODE("MOVI",   "0001dddddddd0000iiiiiiiiiiiiiiii"
+                   "00000000000000000000000000000000", .cycles = 1,
+                   .flags = 0x1),
+  OPCODE("LOADW",  "0011dddddddd00000000000000000000"
+                   "aaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaa", .length = 2,
+                   .memory = MEMORY_READ, .cycles = 3),
+  OPCODE("BRANCH", "0100cccc000000000000000000000000"
+                   "oooooooooooooooooooooooooooooooo", .length = 2,
+                   .flow = FLOW_BRANCH, .cycles = 2),
+  OPCODE("BUNDLE", "1000xxxxxxxxxxxxxxxxxxxxxxxxxxxx"
+                   "xxxxxxxxxxxxxxxxxxxxxxxxxxxxxxx1", .length = 2,
+                   .cycles = 1, .flags = 0x1FF),
+};
+
+OpcodeData wide_128_opcodes[] = {
+  OPCODE("NOP",        "00000000000000000000000000000000"
+                       "00000000000000000000000000000000"
+                       "00000000000000000000000000000000"
+                       "00000000000000000000000000000000", .cycles = 1),
+  OPCODE("MOVI",       "0001dddddddd0000iiiiiiiiiiiiiiii"
+                       "00000000000000000000000000000000"
+                       "00000000000000000000000000000000"
+                       "00000000000000000000000000000000", .cycles = 1,
+                       .flags = 0x1),
+  OPCODE("ADD3",       "0010ddddddddsssssssstttttttt0000"
+                       "00000000000000000000000000000000"
+                       "00000000000000000000000000000000"
+                       "00000000000000000000000000000000", .cycles = 1,
+                       .flags = 0xF),
+  OPCODE("LOADW",      "0011dddddddd00000000000000000000"
+                       "aaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaa"
+                       "00000000000000000000000000000000"
+                       "00000000000000000000000000000000", .length = 2,
+                       .memory = MEMORY_READ, .cycles = 3),
+  OPCODE("BRANCH",     "0100cccc000000000000000000000000"
+                       "oooooooooooooooooooooooooooooooo"
+                       "00000000000000000000000000000000"
+                       "00000000000000000000000000000000", .length = 2,
+                       .flow = FLOW_BRANCH, .cycles = 2),
+  OPCODE("BUNDLE",     "1000xxxxxxxxxxxxxxxxxxxxxxxxxxxx"
+                       "yyyyyyyyyyyyyyyyyyyyyyyyyyyyyy11"
+                       "01zzzzzzzzzzzzzzzzzzzzzzzzzzzzzz"
+                       "zzzzzzzzzzzzzzzzzzzzzzzzzzzzzzzz", .length = 4,
+                       .cycles = 1, .flags = 0x1FF),
+  OPCODE("BUNDLE_NOP", "10010000000000000000000000000000"
+                       "00000000000000000000000000000000"
+                       "00000000000000000000000000000000"
+                       "00000000000000000000000000000001", .length = 4,
+                       .cycles = 1),
+};
+
+// Prints a single header with the decoder, <decode>_le(), <decode>_fetch_le()
+// and the metadata of the 64 or 128 bit ISA, using any backend but autotune.
+int main(int argc, char **argv) {
+  const char *bits = argc > 1 ? argv[1] : "128";
+  const char *backend = argc > 2 ? argv[2] : "switch";
+  OpcodeData *opcodes = wide_128_opcodes;
+  uint16_t size = sizeof(wide_128_opcodes) / sizeof(wide_128_opcodes[0]);
+  if (strcmp(bits, "64") == 0) {
+    opcodes = wide_64_opcodes;
+    size = sizeof(wide_64_opcodes) / sizeof(wide_64_opcodes[0]);
+  } else if (strcmp(bits, "128") != 0) {
+    fprintf(stderr, "unknown width: %s\n", bits);
+    return 1;
+  }
+
+  OpcodenatorData opcodenator = init_opcodenator(opcodes, size, "  ", "op_",
+      "opcode_decode");
+
+  DecoderVariant variants[] = {
+    { BACKEND_SWITCH, 0 },
+    { BACKEND_BRANCHLESS, 0 },
+    { BACKEND_PERFECT_HASH, 0 },
+    { BACKEND_TABLE, 8 },
+    { BACKEND_TABLE, 12 },
+    { BACKEND_TABLE, 16 },
+  };
+  if (strcmp(backend, "table") == 0)
+    backend = "table_12";
+  uint32_t variant = 0;
+  while (variant < sizeof(variants) / sizeof(variants[0]) &&
+      strcmp(backend, get_variant_name(opcodenator, variants[variant]).val)) {
+    variant++;
+  }
+  if (variant == sizeof(variants) / sizeof(variants[0])) {
+    fprintf(stderr, "unknown backend: %s\n", backend);
+    return 1;
+  }
+
+  if (variants[variant].backend == BACKEND_TABLE &&
+      opcodenator.opcode_bits > 64) {
+    fprintf(stderr, "%s only indexes opcodes up to 64 bits\n", backend);
+    return 1;
+  }
+
+  print_includes(opcodenator);
+  printf("\n");
+  print_enum_declaration(opcodenator);
+  printf("\n");
+  print_metadata_declaration(opcodenator);
+  printf("\n");
+  print_decoder_declaration(opcodenator);
+  printf("\n");
+  print_fetch_declarations(opcodenator);
+  printf("\n");
+  print_metadata_definition(opcodenator);
+  printf("\n");
+  print_decoder_variant(opcodenator, variants[variant]);
+  printf("\n");
+  print_pointer_decoder_function(opcodenator, 32);
+  printf("\n");
+  print_fetch_function(opcodenator, 32);
+
+  return 0;
+}
@@ -1,5 +1,7 @@
 #include <stdint.h>
 #include <assert.h>
+#include <pthread.h>
+#include <sched.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdbool.h>
@@ -368,9 +370,451 @@ void test_decode_opcode() {
   }
 }
 
+// AVR stores each 16 bit word little endian, the first word being the most
+// significant half of the 32 bit opcode.
+void test_decode_opcode_le() {
+  for (int i = 0; i < NUM_TEST_OPCODES; i++) {
+    times_ran++;
+    uint32_t value = test_opcodes[i].value;
+    uint8_t bytes[4] = {
+      (value >> 16) & 0xFF, (value >> 24) & 0xFF,
+      (value >>  0) & 0xFF, (value >>  8) & 0xFF,
+    };
+
+    OpcodeType result = opcode_decode_le(bytes);
+    if (result != test_opcodes[i].expected) {
+      printf("Test failed for %s with input 0x%08X, got: %u, exptected %u\n",
+          test_opcodes[i].name, value,
+          result, test_opcodes[i].expected);
+      printf("Test decode_le: %s FAILED\n", test_opcodes[i].name);
+    } else {
+      tests_passed++;
+      printf("Test decode_le: %s PASSED\n", test_opcodes[i].name);
+    }
+  }
+}
+
+// The second word is garbage for 16 bit opcodes, fetch must not look at it.
+void test_fetch_opcode() {
+  for (int i = 0; i < NUM_TEST_OPCODES; i++) {
+    times_ran++;
+    uint32_t value = test_opcodes[i].value;
+    uint8_t words =
+      OPCODE_META_LENGTH(opcode_metadata[test_opcodes[i].expected]);
+    uint8_t bytes[4] = {
+      (value >> 16) & 0xFF, (value >> 24) & 0xFF,
+      words == 2 ? (value >>  0) & 0xFF : 0xFF,
+      words == 2 ? (value >>  8) & 0xFF : 0xFF,
+    };
+
+    DecodedOpcode decoded;
+    uint32_t result_words = opcode_decode_fetch_le(bytes, 2, &decoded);
+    if (decoded.type != test_opcodes[i].expected || result_words != words ||
+        opcode_decode_fetch_le(bytes, words - 1, &decoded) != 0) {
+      printf("Test failed for %s with input 0x%08X, got: %u (%u words), "
+          "exptected %u (%u words)\n", test_opcodes[i].name, value,
+          decoded.type, result_words, test_opcodes[i].expected, words);
+      printf("Test fetch: %s FAILED\n", test_opcodes[i].name);
+    } else {
+      tests_passed++;
+      printf("Test fetch: %s PASSED\n", test_opcodes[i].name);
+    }
+  }
+}
+
+void check(bool success, const char *test_name) {
+  times_ran++;
+  if (success) {
+    tests_passed++;
+    printf("Test %s PASSED\n", test_name);
+  } else {
+    printf("Test %s FAILED\n", test_name);
+  }
+}
+
+void test_block_cache() {
+  uint16_t program[] = {
+    0xE012, // ldi r17, 0x02
+    0xE013, // ldi r17, 0x03
+    0x1701, // cp r16, r17
+    0xF001, // breq .+0
+    0x0000, // nop
+    0x940E, // call 0x100
+    0x0100,
+    0x9508, // ret
+  };
+  uint32_t flash_words = sizeof(program) / sizeof(program[0]);
+  uint8_t flash[sizeof(program)];
+  for (uint32_t i = 0; i < flash_words; i++) {
+    flash[i * 2] = program[i] & 0xFF;
+    flash[i * 2 + 1] = program[i] >> 8;
+  }
+
+  static OpcodeBlockCache cache;
+  opcode_block_cache_init(&cache, flash, flash_words);
+
+  OpcodeBlock *first = opcode_block_lookup(&cache, 0);
+  check(first->size == 4 && first->end == 4 && first->ops[0].type == LDI &&
+      first->ops[3].type == BRBS, "block_cache: split at branch");
+
+  OpcodeBlock *second = opcode_block_next(&cache, first, first->end);
+  check(second->start == 4 && second->size == 2 && second->end == 7 &&
+      second->ops[1].type == CALL && second->ops[1].opcode == 0x940E0100,
+      "block_cache: two word opcode");
+  check(first->next[0] == second && opcode_block_lookup(&cache, 0) == first,
+      "block_cache: chain");
+
+  OpcodeBlock *third = opcode_block_next(&cache, second, 7);
+  check(third->size == 1 && third->ops[0].type == RET &&
+      opcode_block_next(&cache, second, 7) == third, "block_cache: return");
+
+  flash[2] = 0x00;
+  flash[3] = 0x00;
+  opcode_block_invalidate(&cache, 1, 1);
+  first = opcode_block_lookup(&cache, 0);
+  check(first->size == 4 && first->ops[1].type == NOP && second->valid,
+      "block_cache: invalidate");
+
+  check(opcode_block_lookup(&cache, flash_words) == NULL &&
+      opcode_block_next(&cache, third, third->end) == NULL &&
+      third->next[0] == NULL, "block_cache: end of flash");
+
+  // Only the first word of the call fits.
+  static OpcodeBlockCache cut;
+  opcode_block_cache_init(&cut, flash, 6);
+  check(opcode_block_lookup(&cut, 5) == NULL &&
+      opcode_block_lookup(&cut, 4)->size == 1, "block_cache: cut opcode");
+
+  // nops with a ret at 3 and at every multiple of 512 after it, so the blocks
+  // at 0, 512 and 1024 are one slot apart or in the same slot.
+  static uint8_t long_flash[2 * 1100];
+  for (uint32_t i = 3; i < 1100; i += 512) {
+    long_flash[i * 2] = 0x08;
+    long_flash[i * 2 + 1] = 0x95;
+  }
+  static OpcodeBlockCache evict;
+  opcode_block_cache_init(&evict, long_flash, 1100);
+  OpcodeBlock *low = opcode_block_lookup(&evict, 0);
+  OpcodeBlock *middle = opcode_block_lookup(&evict, 512);
+  check(low->end == 4 && middle->end == 516, "block_cache: blocks far apart");
+
+  opcode_block_invalidate(&evict, 2, 1);
+  check(!low->valid && middle->valid, "block_cache: invalidate nearby only");
+
+  low = opcode_block_lookup(&evict, 0);
+  opcode_block_invalidate(&evict, 514, 1000);
+  check(low->valid && !middle->valid, "block_cache: invalidate long write");
+
+  OpcodeBlock *high = opcode_block_next(&evict, low, 1024);
+  check(high == low && high->start == 1024 && high->next[1] == NULL &&
+      opcode_block_lookup(&evict, 0)->start == 0,
+      "block_cache: next evicting from");
+}
+
+void test_metadata() {
+  check(OPCODE_META_LENGTH(opcode_metadata[CALL]) == 2 &&
+      OPCODE_META_FLOW(opcode_metadata[CALL]) == FLOW_CALL,
+      "metadata: CALL");
+  check(OPCODE_META_LENGTH(opcode_metadata[LDS32]) == 2 &&
+      OPCODE_META_FLOW(opcode_metadata[LDS32]) == FLOW_NONE &&
+      OPCODE_META_MEMORY(opcode_metadata[LDS32]) == MEMORY_READ,
+      "metadata: LDS32");
+  check(OPCODE_META_LENGTH(opcode_metadata[ADD]) == 1 &&
+      OPCODE_META_FLOW(opcode_metadata[ADD]) == FLOW_NONE &&
+      OPCODE_META_MEMORY(opcode_metadata[ADD]) == MEMORY_NONE,
+      "metadata: ADD");
+  check(OPCODE_META_FLOW(opcode_metadata[SBRC_SBRS]) == FLOW_SKIP,
+      "metadata: SBRC_SBRS");
+  check(sizeof(opcode_metadata[0]) == 4, "metadata: 32 bit entries");
+
+  // Flags are the bits of SREG: C, Z, N, V, S, H, T, I.
+  check(OPCODE_META_CYCLES(opcode_metadata[CALL]) == 4 &&
+      OPCODE_META_FLAGS(opcode_metadata[CALL]) == 0,
+      "metadata: CALL cycles");
+  check(OPCODE_META_CYCLES(opcode_metadata[ADD]) == 1 &&
+      OPCODE_META_FLAGS(opcode_metadata[ADD]) == 0x3F,
+      "metadata: ADD flags");
+  check(OPCODE_META_FLAGS(opcode_metadata[RETI]) == 0x80 &&
+      OPCODE_META_FLOW(opcode_metadata[RETI]) == FLOW_RETURN,
+      "metadata: RETI flags");
+  check(OPCODE_META_MEMORY(opcode_metadata[PUSH]) == MEMORY_WRITE &&
+      OPCODE_META_MEMORY(opcode_metadata[POP]) == MEMORY_READ &&
+      OPCODE_META_CYCLES(opcode_metadata[POP]) == 2,
+      "metadata: PUSH POP");
+  check(OPCODE_META_MEMORY(opcode_metadata[INDIR_Y_INC]) ==
+      MEMORY_READ_WRITE, "metadata: INDIR_Y_INC");
+  check(OPCODE_META_LENGTH(opcode_metadata[INVALID_OP]) == 1,
+      "metadata: INVALID_OP");
+}
+
+typedef struct {
+  OpcodeType first;
+  OpcodeType second;
+  FusedOpcodeType expected;
+} TestingFusedData;
+
+static const TestingFusedData test_fused[] = {
+  { .first = CP,  .second = BRBS, .expected = FUSED_CP_BRBS  },
+  { .first = CP,  .second = BRBC, .expected = FUSED_CP_BRBC  },
+  { .first = CPC, .second = BRBS, .expected = FUSED_CPC_BRBS },
+  { .first = CPC, .second = BRBC, .expected = FUSED_CPC_BRBC },
+  { .first = LDI, .second = LDI,  .expected = FUSED_LDI_LDI  },
+  { .first = MOV, .second = RET,  .expected = NOT_FUSED      },
+  { .first = CP,  .second = LDI,  .expected = NOT_FUSED      },
+};
+
+void test_decode_fused() {
+  check(FUSED_CP_BRBS == 0 && FUSED_CPC_BRBC + 1 == FUSED_CPC_BRBS,
+      "decode_fused: most frequent first, ties by opcode");
+  for (size_t i = 0; i < sizeof(test_fused) / sizeof(test_fused[0]); i++) {
+    times_ran++;
+    FusedOpcodeType result = opcode_decode_fused(test_fused[i].first,
+        test_fused[i].second);
+    if (result != test_fused[i].expected) {
+      printf("Test decode_fused: %s %s FAILED, got: %u, exptected %u\n",
+          opcodes[test_fused[i].first].name,
+          opcodes[test_fused[i].second].name,
+          result, test_fused[i].expected);
+    } else {
+      tests_passed++;
+      printf("Test decode_fused: %s %s PASSED\n",
+          opcodes[test_fused[i].first].name,
+          opcodes[test_fused[i].second].name);
+    }
+  }
+}
+
+void test_predecode() {
+  uint8_t flash[] = {
+    0x12, 0xE0, // ldi r17, 0x02
+    0x0E, 0x94, // call 0x100
+    0x00, 0x01,
+    0x08, 0x95, // ret
+  };
+  uint32_t flash_words = sizeof(flash) / 2;
+  static _Atomic uint32_t generations[OPCODE_FLASH_PAGES(4)];
+  static OpcodeFlash shared;
+  static OpcodePredecodeCache cache;
+  static OpcodePredecodeCache other;
+  opcode_flash_init(&shared, flash, flash_words, generations);
+  opcode_predecode_init(&cache, &shared);
+  opcode_predecode_init(&other, &shared);
+
+  DecodedOpcode op;
+  check(opcode_predecode(&cache, 0, &op) == 1 && op.type == LDI &&
+      cache.entries[0].words == 1, "predecode: one word opcode");
+  check(opcode_predecode(&cache, 1, &op) == 2 && op.type == CALL &&
+      op.opcode == 0x940E0100, "predecode: two word opcode");
+  check(opcode_predecode(&cache, 4, &op) == 0, "predecode: out of flash");
+
+  opcode_flash_write_begin(&shared, 3, 1);
+  flash[6] = 0x00;
+  flash[7] = 0x00;
+  opcode_flash_write_end(&shared, 3, 1);
+  check(opcode_predecode(&cache, 3, &op) == 1 && op.type == NOP &&
+      opcode_predecode(&other, 3, &op) == 1 && op.type == NOP,
+      "predecode: write seen by every cache");
+  check(atomic_load(&generations[0]) == 2, "predecode: generation bumped");
+  opcode_flash_write_begin(&shared, 2, 0);
+  opcode_flash_write_end(&shared, 2, 0);
+  check(atomic_load(&generations[0]) == 2, "predecode: empty write");
+  // Runs past the last page, which is all generations[] has room for.
+  opcode_flash_write_begin(&shared, 2, 1000);
+  opcode_flash_write_end(&shared, 2, 1000);
+  check(atomic_load(&generations[0]) == 4, "predecode: write past flash");
+  check(opcode_predecode(&cache, 0, &op) == 1 && op.type == LDI,
+      "predecode: refetch after write");
+}
+
+#define PREDECODE_READERS 4
+// Odd, so the flash ends up holding the new opcode.
+#define PREDECODE_WRITES 2001
+
+// call 0x100 and jmp 0x200, the writer flips word 1 and 2 of the flash between
+// them so a reader that mixes the two gets a CALL to 0x200 or a JMP to 0x100.
+static const uint8_t predecode_old[] = { 0x0E, 0x94, 0x00, 0x01 };
+static const uint8_t predecode_new[] = { 0x0C, 0x94, 0x00, 0x02 };
+
+typedef struct {
+  OpcodeFlash *flash;
+  atomic_bool *done;
+  atomic_int *started;
+  OpcodePredecodeCache cache;
+  uint32_t reads;
+  uint32_t torn;
+  bool last_new;
+} PredecodeReader;
+
+static bool is_predecode_old(DecodedOpcode op) {
+  return op.type == CALL && op.opcode == 0x940E0100;
+}
+
+static bool is_predecode_new(DecodedOpcode op) {
+  return op.type == JMP && op.opcode == 0x940C0200;
+}
+
+static void *predecode_reader(void *arg) {
+  PredecodeReader *reader = arg;
+  opcode_predecode_init(&reader->cache, reader->flash);
+  atomic_fetch_add(reader->started, 1);
+
+  DecodedOpcode op;
+  bool done;
+  do {
+    done = atomic_load(reader->done);
+    for (uint32_t pc = 0; pc < 4; pc++) {
+      uint32_t words = opcode_predecode(&reader->cache, pc, &op);
+      if (pc != 1)
+        continue;
+
+      reader->reads++;
+      if (words != 2 || !(is_predecode_old(op) || is_predecode_new(op)))
+        reader->torn++;
+      reader->last_new = is_predecode_new(op);
+    }
+    sched_yield();
+  } while (!done);
+
+  return NULL;
+}
+
+// Readers only ever see one opcode or the other while the writer keeps
+// rewriting it, and all of them see the last write once it's done.
+void test_predecode_threads() {
+  static uint8_t flash[] = {
+    0x12, 0xE0, // ldi r17, 0x02
+    0x0E, 0x94, // call 0x100
+    0x00, 0x01,
+    0x08, 0x95, // ret
+  };
+  static _Atomic uint32_t generations[OPCODE_FLASH_PAGES(4)];
+  static OpcodeFlash shared;
+  static PredecodeReader readers[PREDECODE_READERS];
+  atomic_bool done = false;
+  atomic_int started = 0;
+  opcode_flash_init(&shared, flash, sizeof(flash) / 2, generations);
+
+  pthread_t threads[PREDECODE_READERS];
+  for (int i = 0; i < PREDECODE_READERS; i++) {
+    readers[i] = (PredecodeReader){ .flash = &shared, .done = &done,
+      .started = &started };
+    int error = pthread_create(&threads[i], NULL, predecode_reader,
+        &readers[i]);
+    check(error == 0, "predecode: reader started");
+    if (error != 0) {
+      atomic_store(&done, true);
+      for (int j = 0; j < i; j++) {
+        pthread_join(threads[j], NULL);
+      }
+      return;
+    }
+  }
+  while (atomic_load(&started) < PREDECODE_READERS) {
+    sched_yield();
+  }
+
+  // Byte at a time through a volatile pointer, and now and then the writer
+  // yields halfway, so a reader that doesn't retry catches the write half done
+  // even on a single core.
+  volatile uint8_t *target = &flash[2];
+  for (int i = 0; i < PREDECODE_WRITES; i++) {
+    const uint8_t *bytes = i % 2 == 0 ? predecode_new : predecode_old;
+    opcode_flash_write_begin(&shared, 1, 2);
+    for (int j = 0; j < 4; j++) {
+      target[j] = bytes[j];
+      if (j == 1 && i % 64 == 0)
+        sched_yield();
+    }
+    opcode_flash_write_end(&shared, 1, 2);
+  }
+  atomic_store(&done, true);
+
+  uint32_t reads = 0;
+  uint32_t torn = 0;
+  bool last_new = true;
+  for (int i = 0; i < PREDECODE_READERS; i++) {
+    pthread_join(threads[i], NULL);
+    reads += readers[i].reads;
+    torn += readers[i].torn;
+    last_new &= readers[i].last_new;
+  }
+
+  check(reads > 0 && torn == 0, "predecode threads: old or new opcode only");
+  check(last_new, "predecode threads: last write seen");
+}
+
+typedef struct {
+  OpcodeType types[NUM_TEST_OPCODES];
+  uint32_t size;
+  uint32_t batches;
+  uint32_t calls;
+} StreamResult;
+
+void record_batch(void *user, const DecodedOpcode *ops, uint32_t size) {
+  StreamResult *result = user;
+  result->batches++;
+  for (uint32_t i = 0; i < size && result->size < NUM_TEST_OPCODES; i++) {
+    result->types[result->size++] = ops[i].type;
+  }
+}
+
+void count_call(void *user, const DecodedOpcode *op) {
+  StreamResult *result = user;
+  result->calls += op->type == CALL;
+}
+
+// Fed in chunks of 1 to 7 bytes so opcodes get cut anywhere.
+void test_stream() {
+  static uint8_t bytes[NUM_TEST_OPCODES * 4 + 1];
+  uint32_t size = 0;
+  uint32_t calls = 0;
+  for (int i = 0; i < NUM_TEST_OPCODES; i++) {
+    uint32_t value = test_opcodes[i].value;
+    bytes[size++] = (value >> 16) & 0xFF;
+    bytes[size++] = (value >> 24) & 0xFF;
+    if (OPCODE_META_LENGTH(opcode_metadata[test_opcodes[i].expected]) == 2) {
+      bytes[size++] = (value >> 0) & 0xFF;
+      bytes[size++] = (value >> 8) & 0xFF;
+    }
+    calls += test_opcodes[i].expected == CALL;
+  }
+  bytes[size++] = 0x0E; // first byte of a call
+
+  StreamResult result = { .size = 0 };
+  static OpcodeStream stream;
+  opcode_stream_init(&stream, &result);
+  stream.batch = record_batch;
+  stream.handlers[CALL] = count_call;
+  for (uint32_t pos = 0, chunk = 1; pos < size; pos += chunk, chunk++) {
+    if (chunk > 7)
+      chunk = 1;
+    if (chunk > size - pos)
+      chunk = size - pos;
+    opcode_stream_feed(&stream, bytes + pos, chunk);
+  }
+
+  bool same = result.size == NUM_TEST_OPCODES;
+  for (int i = 0; same && i < NUM_TEST_OPCODES; i++) {
+    same = result.types[i] == test_opcodes[i].expected;
+  }
+  check(same, "stream: every opcode in order");
+  check(calls > 0 && result.calls == calls, "stream: type handler");
+  check(result.batches > 1 && stream.size == 0, "stream: batched");
+  check(opcode_stream_finish(&stream) == 1 && stream.carry_size == 0,
+      "stream: cut opcode left over");
+}
+
 int main(void) {
   test_decode_opcode();
+  test_decode_opcode_le();
+  test_fetch_opcode();
+  test_block_cache();
+  test_predecode();
+  test_predecode_threads();
+  test_stream();
+  test_metadata();
+  test_decode_fused();
   printf("%d out of %d tests passed\n", tests_passed, times_ran);
 
-  return 1;
+  return tests_passed != times_ran;
 }
@@ -0,0 +1,105 @@
+#include <stdint.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+
+// Built with OPCODE_DECODE_PROFILE against a switch decoder, the only backend
+// with profiling counters.
+#include "profile_decoder.h"
+
+#define PROFILE_THREADS 2
+#define PROFILE_LDIS 1000
+#define PROFILE_RETS 500
+
+int times_ran = 0;
+int tests_passed = 0;
+
+void check(bool success, const char *test_name) {
+  times_ran++;
+  if (success) {
+    tests_passed++;
+    printf("Test %s PASSED\n", test_name);
+  } else {
+    printf("Test %s FAILED\n", test_name);
+  }
+}
+
+static void *decode_stream(void *arg) {
+  (void)arg;
+  for (int i = 0; i < PROFILE_LDIS; i++) {
+    opcode_decode(0xE0120000); // ldi r17, 0x02
+  }
+  for (int i = 0; i < PROFILE_RETS; i++) {
+    opcode_decode(0x95080000); // ret
+  }
+
+  return NULL;
+}
+
+// Every thread counts on its own, the dump has to add them up.
+void test_profile_dump() {
+  pthread_t threads[PROFILE_THREADS];
+  for (int i = 0; i < PROFILE_THREADS; i++) {
+    int error = pthread_create(&threads[i], NULL, decode_stream, NULL);
+    check(error == 0, "profile: thread started");
+  }
+  for (int i = 0; i < PROFILE_THREADS; i++) {
+    pthread_join(threads[i], NULL);
+  }
+
+  char path[] = "/tmp/opcode_profile_XXXXXX";
+  int fd = mkstemp(path);
+  check(fd >= 0, "profile: temporary file");
+  if (fd < 0)
+    return;
+  close(fd);
+  check(opcode_profile_dump(path) == 0, "profile: dump");
+
+  unsigned long long total = PROFILE_THREADS * (PROFILE_LDIS + PROFILE_RETS);
+  unsigned long long ldi = 0;
+  unsigned long long ret = 0;
+  unsigned long long root = 0;
+  int leaves = 0;
+  bool nodes_in_range = true;
+  bool lines_valid = true;
+
+  FILE *f = fopen(path, "r");
+  char line[256];
+  while (f != NULL && fgets(line, sizeof(line), f) != NULL) {
+    char name[64];
+    unsigned int id;
+    unsigned long long count;
+    if (sscanf(line, "leaf %63s %llu", name, &count) == 2) {
+      leaves++;
+      if (strcmp(name, "LDI") == 0)
+        ldi = count;
+      else if (strcmp(name, "RET") == 0)
+        ret = count;
+    } else if (sscanf(line, "node %u %llu opcode & 0x%*X", &id,
+          &count) == 2) {
+      if (id == 0)
+        root = count;
+      nodes_in_range &= count > 0 && count <= total;
+    } else {
+      lines_valid = false;
+    }
+  }
+  if (f != NULL)
+    fclose(f);
+  remove(path);
+
+  check(lines_valid, "profile: line format");
+  check(leaves == 2 && ldi == PROFILE_THREADS * PROFILE_LDIS &&
+      ret == PROFILE_THREADS * PROFILE_RETS, "profile: leaf counts");
+  check(root == total && nodes_in_range, "profile: node counts");
+}
+
+int main(void) {
+  test_profile_dump();
+  printf("%d out of %d tests passed\n", tests_passed, times_ran);
+
+  return tests_passed != times_ran;
+}
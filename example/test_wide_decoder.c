@@ -0,0 +1,158 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <time.h>
+
+// Built once per ISA of generate_wide_decoder, with WIDE_BITS set to 64 or 128.
+#if WIDE_BITS == 64
+#include "wide_decoder_64.h"
+#define WORDS 2
+typedef uint64_t Opcode;
+#else
+#include "wide_decoder_128.h"
+#define WORDS 4
+typedef OpcodeWide Opcode;
+#endif
+
+typedef struct {
+  char name[32];
+  // Words as they are stored, the most significant one first.
+  uint32_t value[WORDS];
+  uint32_t mask[WORDS];
+  OpcodeType expected;
+} TestingWideData;
+
+static const TestingWideData test_opcodes[] = {
+#if WIDE_BITS == 64
+  { "NOP",     { 0x00000000, 0x00000000 }, { 0x00000000, 0x00000000 }, NOP        },
+  { "MOVI",    { 0x10000000, 0x00000000 }, { 0x0FF0FFFF, 0x00000000 }, MOVI       },
+  { "LOADW",   { 0x30000000, 0x00000000 }, { 0x0FF00000, 0xFFFFFFFF }, LOADW      },
+  { "BRANCH",  { 0x40000000, 0x00000000 }, { 0x0F000000, 0xFFFFFFFF }, BRANCH     },
+  { "BUNDLE",  { 0x80000000, 0x00000001 }, { 0x0FFFFFFF, 0xFFFFFFFE }, BUNDLE     },
+  { "INVALID", { 0x50000000, 0x00000000 }, { 0x0FFFFFFF, 0xFFFFFFFF }, INVALID_OP },
+#else
+  { "NOP",        { 0x00000000, 0x00000000, 0x00000000, 0x00000000 },
+                  { 0x00000000, 0x00000000, 0x00000000, 0x00000000 }, NOP        },
+  { "MOVI",       { 0x10000000, 0x00000000, 0x00000000, 0x00000000 },
+                  { 0x0FF0FFFF, 0x00000000, 0x00000000, 0x00000000 }, MOVI       },
+  { "ADD3",       { 0x20000000, 0x00000000, 0x00000000, 0x00000000 },
+                  { 0x0FFFFFF0, 0x00000000, 0x00000000, 0x00000000 }, ADD3       },
+  { "LOADW",      { 0x30000000, 0x00000000, 0x00000000, 0x00000000 },
+                  { 0x0FF00000, 0xFFFFFFFF, 0x00000000, 0x00000000 }, LOADW      },
+  { "BRANCH",     { 0x40000000, 0x00000000, 0x00000000, 0x00000000 },
+                  { 0x0F000000, 0xFFFFFFFF, 0x00000000, 0x00000000 }, BRANCH     },
+  { "BUNDLE",     { 0x80000000, 0x00000003, 0x40000000, 0x00000000 },
+                  { 0x0FFFFFFF, 0xFFFFFFFC, 0x3FFFFFFF, 0xFFFFFFFF }, BUNDLE     },
+  { "BUNDLE_NOP", { 0x90000000, 0x00000000, 0x00000000, 0x00000001 },
+                  { 0x00000000, 0x00000000, 0x00000000, 0x00000000 }, BUNDLE_NOP },
+  { "INVALID",    { 0x50000000, 0x00000000, 0x00000000, 0x00000000 },
+                  { 0x0FFFFFFF, 0xFFFFFFFF, 0xFFFFFFFF, 0xFFFFFFFF }, INVALID_OP },
+#endif
+};
+#define NUM_TEST_OPCODES (int)(sizeof(test_opcodes) / sizeof(test_opcodes[0]))
+
+int times_ran = 0;
+int tests_passed = 0;
+
+void check(bool success, const char *test_name) {
+  times_ran++;
+  if (success) {
+    tests_passed++;
+    printf("Test %s PASSED\n", test_name);
+  } else {
+    printf("Test %s FAILED\n", test_name);
+  }
+}
+
+Opcode get_opcode(const uint32_t *words) {
+#if WIDE_BITS == 64
+  return (uint64_t)words[0] << 32 | words[1];
+#else
+  Opcode opcode = { 0 };
+  opcode[1] = (uint64_t)words[0] << 32 | words[1];
+  opcode[0] = (uint64_t)words[2] << 32 | words[3];
+  return opcode;
+#endif
+}
+
+// Every word is stored little endian.
+void get_bytes(const uint32_t *words, uint8_t *bytes) {
+  for (int i = 0; i < WORDS; i++) {
+    for (int j = 0; j < 4; j++) {
+      bytes[i * 4 + j] = words[i] >> (j * 8) & 0xFF;
+    }
+  }
+}
+
+void test_decode_opcode() {
+  srand(time(NULL));
+  for (int i = 0; i < NUM_TEST_OPCODES; i++) {
+    const TestingWideData *test = &test_opcodes[i];
+    uint32_t words[WORDS];
+    bool success = true;
+
+    for (int j = 0; j < 102 && success; j++) {
+      for (int k = 0; k < WORDS; k++) {
+        uint32_t operands = j == 0 ? 0 : j == 1 ? 0xFFFFFFFF :
+          (uint32_t)(rand() & 0xFFFF) | (uint32_t)(rand() & 0xFFFF) << 16;
+        words[k] = test->value[k] | (test->mask[k] & operands);
+      }
+
+      uint8_t bytes[WORDS * 4];
+      get_bytes(words, bytes);
+      success = opcode_decode(get_opcode(words)) == test->expected &&
+        opcode_decode_le(bytes) == test->expected;
+    }
+
+    char name[64];
+    snprintf(name, sizeof(name), "wide decode: %s", test->name);
+    check(success, name);
+  }
+}
+
+// Words past the opcode's length are garbage, fetch must not look at them.
+void test_fetch_opcode() {
+  for (int i = 0; i < NUM_TEST_OPCODES; i++) {
+    const TestingWideData *test = &test_opcodes[i];
+    uint8_t length = OPCODE_META_LENGTH(opcode_metadata[test->expected]);
+    uint32_t words[WORDS];
+    for (int k = 0; k < WORDS; k++) {
+      words[k] = k < length ? test->value[k] : 0xFFFFFFFF;
+    }
+
+    uint8_t bytes[WORDS * 4];
+    get_bytes(words, bytes);
+    DecodedOpcode decoded;
+    bool success = opcode_decode_fetch_le(bytes, WORDS, &decoded) == length &&
+      decoded.type == test->expected &&
+      opcode_decode_fetch_le(bytes, length - 1, &decoded) == 0;
+
+    char name[64];
+    snprintf(name, sizeof(name), "wide fetch: %s", test->name);
+    check(success, name);
+  }
+}
+
+void test_metadata() {
+  check(sizeof(opcode_metadata[0]) == 8, "wide metadata: 64 bit entries");
+  check(OPCODE_META_FLAGS(opcode_metadata[BUNDLE]) == 0x1FF &&
+      OPCODE_META_LENGTH(opcode_metadata[BUNDLE]) == WORDS &&
+      OPCODE_META_CYCLES(opcode_metadata[BUNDLE]) == 1,
+      "wide metadata: BUNDLE");
+  check(OPCODE_META_MEMORY(opcode_metadata[LOADW]) == MEMORY_READ &&
+      OPCODE_META_CYCLES(opcode_metadata[LOADW]) == 3,
+      "wide metadata: LOADW");
+  check(OPCODE_META_FLOW(opcode_metadata[BRANCH]) == FLOW_BRANCH &&
+      OPCODE_META_FLAGS(opcode_metadata[MOVI]) == 0x1,
+      "wide metadata: BRANCH MOVI");
+}
+
+int main(void) {
+  test_decode_opcode();
+  test_fetch_opcode();
+  test_metadata();
+  printf("%d out of %d tests passed\n", tests_passed, times_ran);
+
+  return tests_passed != times_ran;
+}
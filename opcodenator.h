@@ -1,17 +1,50 @@
 #ifndef OPCODENATOR_H
 #define OPCODENATOR_H
 
+#include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
+#include <stdio.h>
 
 #define MAX_ENUM_STR 64
-#define MAX_OPCODE_BITS 64
+#define MAX_OPCODE_BITS 128
+#define OPCODE_LANES (MAX_OPCODE_BITS / 64)
+#define MAX_TABLE_BITS 20
+
+// Opcode bits split in 64 bit lanes, lanes[0] holds the least significant bits.
+typedef struct {
+  uint64_t lanes[OPCODE_LANES];
+} OpcodeValue;
+
+typedef enum {
+  FLOW_NONE,
+  FLOW_BRANCH,
+  FLOW_CALL,
+  FLOW_RETURN,
+  FLOW_SKIP,
+} OpcodeFlow;
+
+typedef enum {
+  MEMORY_NONE,
+  MEMORY_READ,
+  MEMORY_WRITE,
+  MEMORY_READ_WRITE,
+  MEMORY_PROGRAM,
+} OpcodeMemory;
 
 typedef struct {
   char enum_str[MAX_ENUM_STR];
-  char opcode_str[MAX_OPCODE_BITS];
-  uint64_t zeroed_value;
-  uint64_t oned_value;
+  char opcode_str[MAX_OPCODE_BITS + 1];
+  OpcodeValue zeroed_value;
+  OpcodeValue oned_value;
+  // Optional attributes, see OPCODE(). length is in words, 0 is the same as 1.
+  // flags is a bitmask of the flags the opcode affects, its meaning is up to
+  // the user.
+  OpcodeFlow flow;
+  uint8_t length;
+  uint8_t cycles;
+  uint16_t flags;
+  OpcodeMemory memory;
 } OpcodeData;
 
 typedef struct {
@@ -22,6 +55,37 @@ typedef struct {
   uint8_t opcode_width;
 } IndentationData;
 
+typedef enum {
+  BACKEND_SWITCH,
+  BACKEND_BRANCHLESS,
+  BACKEND_PERFECT_HASH,
+  BACKEND_TABLE,
+} DecoderBackend;
+
+typedef struct {
+  DecoderBackend backend;
+  // Only for BACKEND_TABLE, how many of the top bits index the table. A table
+  // on every bit is a flat table.
+  uint8_t table_bits;
+} DecoderVariant;
+
+typedef struct {
+  DecoderVariant variant;
+  // Negative when the benchmark couldn't be built or run.
+  double ns_per_decode;
+  // Set when the variant decoded the workload differently from the reference,
+  // it's never picked then.
+  bool mismatch;
+} DecoderBenchmark;
+
+// first and second are indices into OpcodenatorData.opcodes, which are also the
+// OpcodeType values in the generated code.
+typedef struct {
+  uint16_t first;
+  uint16_t second;
+  uint64_t count;
+} OpcodePair;
+
 typedef struct {
   OpcodeData *opcodes;
   const uint16_t size;
@@ -30,17 +94,83 @@ typedef struct {
   const char *function_prefix;
   const char *decode_function_name;
   const IndentationData indent_data;
+  // Emit profiling counters in the decoder, see print_profile_declarations().
+  bool profile;
+  // Where the print_* functions write, stdout unless changed.
+  FILE *stream;
 } OpcodenatorData;
 
 OpcodenatorData init_opcodenator(OpcodeData *opcodes, uint16_t n,
     const char *indentation_string, const char *function_prefix,
     const char *decode_function_name);
-void print_includes();
+void print_includes(OpcodenatorData d);
 void print_enum_declaration(OpcodenatorData d);
 void print_struct_declaration(OpcodenatorData d);
 void print_function_declarations(OpcodenatorData d);
+void print_empty_function_definitions(OpcodenatorData d);
+void print_array_declaration(OpcodenatorData d);
 void print_array_definition(OpcodenatorData d);
+void print_profile_declarations(OpcodenatorData d);
+void print_decoder_declaration(OpcodenatorData d);
 void print_decoder_function(OpcodenatorData d);
+void print_branchless_tables(OpcodenatorData d);
+void write_branchless_blob(OpcodenatorData d, FILE *blob);
+void print_branchless_blob_declarations(OpcodenatorData d);
+void print_branchless_blob_assembly(OpcodenatorData d,
+    const char *blob_path);
+void print_branchless_decoder_function(OpcodenatorData d);
+void print_perfect_hash_tables(OpcodenatorData d);
+void write_perfect_hash_blob(OpcodenatorData d, FILE *blob);
+void print_perfect_hash_blob_declarations(OpcodenatorData d);
+void print_perfect_hash_blob_assembly(OpcodenatorData d,
+    const char *blob_path);
+void print_perfect_hash_decoder_function(OpcodenatorData d);
+void print_table_tables(OpcodenatorData d, uint8_t table_bits);
+void write_table_blob(OpcodenatorData d, uint8_t table_bits, FILE *blob);
+void print_table_blob_declarations(OpcodenatorData d, uint8_t table_bits);
+void print_table_blob_assembly(OpcodenatorData d, uint8_t table_bits,
+    const char *blob_path);
+void print_table_decoder_function(OpcodenatorData d, uint8_t table_bits);
+void print_decoder_variant(OpcodenatorData d, DecoderVariant variant);
+bool variant_has_blob(DecoderVariant variant);
+void write_decoder_blob(OpcodenatorData d, DecoderVariant variant, FILE *blob);
+void print_decoder_blob_variant(OpcodenatorData d, DecoderVariant variant);
+void print_decoder_blob_assembly(OpcodenatorData d, DecoderVariant variant,
+    const char *blob_path);
+uint64_t *read_workload(const char *path, size_t *size);
+uint32_t autotune_decoder(OpcodenatorData d, DecoderBenchmark *variants,
+    uint32_t n, const uint64_t *workload, size_t workload_size);
+void print_autotune_report(OpcodenatorData d, const DecoderBenchmark *variants,
+    uint32_t n, uint32_t best);
+void print_pointer_decoder_function(OpcodenatorData d, uint8_t word_bits);
+void print_fetch_declarations(OpcodenatorData d);
+void print_fetch_function(OpcodenatorData d, uint8_t word_bits);
+void print_block_cache_declarations(OpcodenatorData d);
+void print_block_cache(OpcodenatorData d, uint8_t word_bits);
+void print_predecode_declarations(OpcodenatorData d);
+void print_predecode_cache(OpcodenatorData d, uint8_t word_bits);
+void print_stream_declarations(OpcodenatorData d);
+void print_stream_decoder(OpcodenatorData d, uint8_t word_bits);
+void print_metadata_declaration(OpcodenatorData d);
+void print_metadata_definition(OpcodenatorData d);
+
+uint16_t get_opcode_index(OpcodenatorData d, const char *enum_str);
+uint32_t get_pairs_from_trace(const uint16_t *trace, size_t n,
+    OpcodePair *output);
+uint32_t get_hot_pairs(OpcodenatorData d, OpcodePair *pairs, uint32_t n,
+    uint32_t max_pairs, uint32_t min_count);
+void print_fused_enum_declaration(OpcodenatorData d, const OpcodePair *pairs,
+    uint32_t n);
+void print_fused_struct_declaration(OpcodenatorData d);
+void print_fused_function_declarations(OpcodenatorData d,
+    const OpcodePair *pairs, uint32_t n);
+void print_fused_empty_function_definitions(OpcodenatorData d,
+    const OpcodePair *pairs, uint32_t n);
+void print_fused_array_definition(OpcodenatorData d, const OpcodePair *pairs,
+    uint32_t n);
+void print_fused_decoder_declaration(OpcodenatorData d);
+void print_fused_decoder_function(OpcodenatorData d, const OpcodePair *pairs,
+    uint32_t n);
 
 #endif // OPCODENATOR_H
 
@@ -53,6 +183,7 @@ void print_decoder_function(OpcodenatorData d);
 #include <stdlib.h> 
 #include <string.h>
 #include <math.h>
+#include <unistd.h>
 
 #ifdef OPCODENATOR_IMPLEMENTATION
 
@@ -62,10 +193,37 @@ static const char zero_table_col[]   = "ZEROED VALUE";
 static const char one_table_col[]    = "ONED VALUE";
 static const char opcode_table_col[] = "OPCODE STRING";
 
+// Enum names as emitted in the generated code
+static const char *flow_str[] = {
+  [FLOW_NONE]   = "FLOW_NONE",
+  [FLOW_BRANCH] = "FLOW_BRANCH",
+  [FLOW_CALL]   = "FLOW_CALL",
+  [FLOW_RETURN] = "FLOW_RETURN",
+  [FLOW_SKIP]   = "FLOW_SKIP",
+};
+static const char *memory_str[] = {
+  [MEMORY_NONE]       = "MEMORY_NONE",
+  [MEMORY_READ]       = "MEMORY_READ",
+  [MEMORY_WRITE]      = "MEMORY_WRITE",
+  [MEMORY_READ_WRITE] = "MEMORY_READ_WRITE",
+  [MEMORY_PROGRAM]    = "MEMORY_PROGRAM",
+};
+
+// Layout of the packed opcode_metadata[] entries, flags go last so the table
+// only needs 64 bit entries if some opcode uses more than 8 flags.
+#define METADATA_CYCLES_SHIFT 0
+#define METADATA_LENGTH_SHIFT 8
+#define METADATA_FLOW_SHIFT   12
+#define METADATA_MEMORY_SHIFT 16
+#define METADATA_FLAGS_SHIFT  24
+
 #define MAX_SHORT_STRING 256
 
-#define OPCODE(estr, opstr) { .enum_str = estr, .opcode_str = opstr, \
-  .zeroed_value = 0, .oned_value = 0 }
+// Attributes are optional designated initializers, for example:
+// OPCODE("CALL", "1001010kkkkk111kkkkkkkkkkkkkkkkk", .flow = FLOW_CALL,
+//     .length = 2)
+#define OPCODE(estr, opstr, ...) { .enum_str = estr, .opcode_str = opstr, \
+  .zeroed_value = { { 0 } }, .oned_value = { { 0 } }, __VA_ARGS__ }
 
 #define FMT_CHECK(a, b) __attribute__ ((format(printf, a, b)))
 
@@ -101,32 +259,131 @@ FMT_CHECK(4, 5) void ind_fprintf(FILE *stream,
   va_end(va);
 }
 
-uint64_t get_zeroed(const char *opcode_str, uint8_t opcode_bits) {
-  uint64_t ret = 0;
+OpcodeValue value_and(OpcodeValue a, OpcodeValue b) {
+  for (int i = 0; i < OPCODE_LANES; i++) {
+    a.lanes[i] &= b.lanes[i];
+  }
+
+  return a;
+}
+
+bool value_equal(OpcodeValue a, OpcodeValue b) {
+  for (int i = 0; i < OPCODE_LANES; i++) {
+    if (a.lanes[i] != b.lanes[i])
+      return false;
+  }
+
+  return true;
+}
+
+void value_set_bit(OpcodeValue *value, uint8_t bit) {
+  value->lanes[bit / 64] |= (uint64_t)1 << (bit % 64);
+}
+
+void value_clear_bit(OpcodeValue *value, uint8_t bit) {
+  value->lanes[bit / 64] &= ~((uint64_t)1 << (bit % 64));
+}
+
+// Every bit of an opcode_bits wide opcode set.
+OpcodeValue get_opcode_mask(uint8_t opcode_bits) {
+  OpcodeValue ret = { { 0 } };
+
+  for (int i = 0; i < opcode_bits; i++) {
+    value_set_bit(&ret, i);
+  }
+
+  return ret;
+}
+
+OpcodeValue get_zeroed(const char *opcode_str, uint8_t opcode_bits) {
+  OpcodeValue ret = { { 0 } };
 
   for (int i = 0; i < opcode_bits; i++) {
     if (opcode_str[i] == '1' || isalpha(opcode_str[i]))
-      ret |= ((uint64_t)1 << (opcode_bits - i -1));
+      value_set_bit(&ret, opcode_bits - i - 1);
   }
 
   return ret;
 }
 
-uint64_t get_oned(const char *opcode_str, uint8_t opcode_bits) {
-  uint64_t ret = 0;
+OpcodeValue get_oned(const char *opcode_str, uint8_t opcode_bits) {
+  OpcodeValue ret = { { 0 } };
 
   for (int i = 0; i < opcode_bits; i++) {
     if (opcode_str[i] == '1')
-      ret |= ((uint64_t)1 << (opcode_bits - i -1));
+      value_set_bit(&ret, opcode_bits - i - 1);
+  }
+
+  return ret;
+}
+
+// Bits that are a literal '0' or '1' in the opcode string, i.e. the bits an
+// input has to match for it to be this opcode.
+OpcodeValue get_fixed_bits(OpcodeData opcode, uint8_t opcode_bits) {
+  OpcodeValue ret = get_opcode_mask(opcode_bits);
+
+  for (int i = 0; i < OPCODE_LANES; i++) {
+    ret.lanes[i] &= ~(opcode.zeroed_value.lanes[i] ^
+        opcode.oned_value.lanes[i]);
   }
 
   return ret;
 }
 
-uint64_t get_static_bits(const OpcodeData *opcodes, uint16_t n,
+// Hex string for error messages, hex_width is the number of digits.
+ShortString get_value_hex_str(OpcodeValue value, int hex_width) {
+  if (hex_width <= 16)
+    return shortf("0x%0*lX", hex_width, value.lanes[0]);
+
+  return shortf("0x%0*lX%016lX", hex_width - 16, value.lanes[1],
+      value.lanes[0]);
+}
+
+// Value as a constant in the generated code, opcodes wider than 64 bits are
+// OpcodeWide vectors with the least significant lane first.
+ShortString get_value_literal_str(OpcodeValue value, uint8_t opcode_bits,
+    int hex_width) {
+  if (opcode_bits <= 64)
+    return shortf("0x%0*lX", hex_width, value.lanes[0]);
+
+  return shortf("{ 0x%016lX, 0x%016lX }", value.lanes[0], value.lanes[1]);
+}
+
+// Narrowest native type that fits opcode_bits, used for every opcode in the
+// generated code.
+const char *get_opcode_type_str(uint8_t opcode_bits) {
+  if (opcode_bits <= 8)
+    return "uint8_t";
+  if (opcode_bits <= 16)
+    return "uint16_t";
+  if (opcode_bits <= 32)
+    return "uint32_t";
+  if (opcode_bits <= 64)
+    return "uint64_t";
+  return "OpcodeWide";
+}
+
+// Byte size of get_opcode_type_str(opcode_bits).
+uint32_t get_opcode_type_bytes(uint8_t opcode_bits) {
+  if (opcode_bits > 64)
+    return 16;
+
+  uint32_t type_bytes = 1;
+  while (type_bytes * 8 < opcode_bits) {
+    type_bytes *= 2;
+  }
+
+  return type_bytes;
+}
+
+// Type backing OpcodeType, n does not include INVALID_OP.
+const char *get_enum_type_str(uint16_t n) {
+  return n <= UINT8_MAX ? "uint8_t" : "uint16_t";
+}
+
+OpcodeValue get_static_bits(const OpcodeData *opcodes, uint16_t n,
     uint8_t opcode_bits) {
-  uint64_t opcode_mask = ((uint64_t)1 << opcode_bits) - 1;
-  uint64_t ret = 0xFFFFFFFFFFFFFFFF & opcode_mask;
+  OpcodeValue ret = get_opcode_mask(opcode_bits);
 
   for (int i = 0; i < n; i++) {
     assert(strlen(opcodes[i].enum_str) > 0);
@@ -134,7 +391,7 @@ uint64_t get_static_bits(const OpcodeData *opcodes, uint16_t n,
     assert(strlen(opcodes[i].opcode_str) == opcode_bits);
     for (int j = 0; j < opcode_bits; j++) {
       if (isalpha(opcodes[i].opcode_str[j])) {
-        ret &= ~((uint64_t)1 << (opcode_bits - j -1));
+        value_clear_bit(&ret, opcode_bits - j - 1);
       }
     }
   }
@@ -142,33 +399,33 @@ uint64_t get_static_bits(const OpcodeData *opcodes, uint16_t n,
   return ret;
 }
 
-uint32_t get_ids(const OpcodeData *input, size_t n, uint64_t static_bits,
-    uint64_t *output) {
+// ids are per lane, the value's lane anded with that lane's static_bits
+uint32_t get_ids(const OpcodeData *input, size_t n, uint8_t lane,
+    uint64_t static_bits, uint64_t *output) {
   uint32_t count = 0;
 
   for (size_t i = 0; i < n; i++) {
     bool exists = false;
     for (size_t j = 0; j < count; j++) {
-      if ((input[i].zeroed_value & static_bits) == output[j]) {
+      if ((input[i].zeroed_value.lanes[lane] & static_bits) == output[j]) {
         exists = true;
         break;
       }
     }
 
     if (!exists)
-      output[count++] = input[i].zeroed_value & static_bits;
+      output[count++] = input[i].zeroed_value.lanes[lane] & static_bits;
   }
 
   return count;
 }
 
-// id is simply the value anded with the static_bits
-uint32_t get_opcodes_by_id(const OpcodeData *input, size_t n,
+uint32_t get_opcodes_by_id(const OpcodeData *input, size_t n, uint8_t lane,
     uint64_t id, uint64_t static_bits, OpcodeData *output) {
   uint32_t count = 0;
   
   for (size_t i = 0; i < n; i++) {
-    if ((input[i].zeroed_value & static_bits) == id) {
+    if ((input[i].zeroed_value.lanes[lane] & static_bits) == id) {
       output[count++] = input[i];
     }
   }
@@ -176,6 +433,25 @@ uint32_t get_opcodes_by_id(const OpcodeData *input, size_t n,
   return count;
 }
 
+// A switch only looks at one lane, pick the one that tells the most opcodes
+// apart. Opcodes that fit in 64 bits always get lane 0.
+uint8_t get_switch_lane(const OpcodeData *opcodes, uint16_t n,
+    OpcodeValue static_bits) {
+  uint64_t ids[n];
+  uint8_t ret = 0;
+  uint32_t max_ids = 0;
+
+  for (uint8_t i = 0; i < OPCODE_LANES; i++) {
+    uint32_t ids_size = get_ids(opcodes, n, i, static_bits.lanes[i], ids);
+    if (ids_size > max_ids) {
+      max_ids = ids_size;
+      ret = i;
+    }
+  }
+
+  return ret;
+}
+
 IndentationData get_table_indentation(IndentationData ind) {
   uint8_t enum_width = strlen(enum_table_col) > ind.enum_name_width ?
     strlen(enum_table_col) : ind.enum_name_width;
@@ -212,10 +488,10 @@ void print_table_head(IndentationData ind) {
 // the table's indentation, you gt this by using get_table_indentation()
 void print_table_row(OpcodeData opcode, IndentationData op_ind,
     IndentationData table_ind) {
-  ShortString zero_hex_str = shortf("0x%0*lX",
-      op_ind.opcode_hex_width, opcode.zeroed_value);
-  ShortString one_hex_str = shortf("0x%0*lX",
-      op_ind.opcode_hex_width, opcode.oned_value);
+  ShortString zero_hex_str = get_value_hex_str(opcode.zeroed_value,
+      op_ind.opcode_hex_width);
+  ShortString one_hex_str = get_value_hex_str(opcode.oned_value,
+      op_ind.opcode_hex_width);
 
   fprintf(stderr, "%-*s %-*s %-*s %-*s\n",
       table_ind.enum_name_width, opcode.enum_str,
@@ -230,8 +506,8 @@ bool check_for_duplicates(const OpcodeData *opcodes,
 
   for (uint16_t i = 0; i < n; i++) {
     for (uint16_t j = i + 1; j < n; j++) {
-      if (opcodes[i].zeroed_value == opcodes[j].zeroed_value &&
-          opcodes[i].oned_value   == opcodes[j].oned_value) {
+      if (value_equal(opcodes[i].zeroed_value, opcodes[j].zeroed_value) &&
+          value_equal(opcodes[i].oned_value, opcodes[j].oned_value)) {
         ret = true;
 
         fprintf(stderr, "duplicate detected:\n");
@@ -246,53 +522,118 @@ bool check_for_duplicates(const OpcodeData *opcodes,
   return ret;
 }
 
-void print_decoder_switch(const char *ind_str, int ind_lvl,
-    const OpcodeData *opcodes, uint16_t n, IndentationData indent_data) {
-  uint64_t static_bits = get_static_bits(opcodes, n, indent_data.opcode_width);
+// node_id numbers the switches in the order they are printed, it's only used
+// when profile is set. Opcodes wider than 64 bits are switched on one lane at a
+// time and their leaves compare every fixed bit at once with a single 128 bit
+// vector operation, since a lane switch can leave the other lane unchecked.
+void print_decoder_switch(FILE *stream, const char *ind_str, int ind_lvl,
+    const OpcodeData *opcodes, uint16_t n, IndentationData indent_data,
+    bool profile, uint32_t *node_id) {
+  uint8_t opcode_bits = indent_data.opcode_width;
+  bool wide = opcode_bits > 64;
+  OpcodeValue static_bits = get_static_bits(opcodes, n, opcode_bits);
+  uint8_t lane = get_switch_lane(opcodes, n, static_bits);
   uint64_t ids[n];
-  uint32_t ids_size = get_ids(opcodes, n, static_bits, ids);
+  uint32_t ids_size = get_ids(opcodes, n, lane, static_bits.lanes[lane], ids);
+  int hex_width = wide ? 16 : indent_data.opcode_hex_width;
   
   assert(ids_size > 0 && "should not be posisble to get here and have no ids");
+  if (profile) {
+    ind_fprintf(stream, ind_str, ind_lvl, "OPCODE_PROFILE_NODE(%u);\n",
+        (*node_id)++);
+  }
   if (ids_size > 1) {
-  ind_fprintf(stdout, ind_str, ind_lvl, "switch (opcode & 0x%0*lX) {\n",
-      indent_data.opcode_hex_width, static_bits);
+  ShortString opcode_lane = wide ? shortf("opcode[%u]", lane) :
+    shortf("opcode");
+  ind_fprintf(stream, ind_str, ind_lvl, "switch (%s & 0x%0*lX) {\n",
+      opcode_lane.val, hex_width, static_bits.lanes[lane]);
   }
 
   for (uint32_t i = 0; i < ids_size; i++) {
     OpcodeData next[n];
-    uint16_t next_size = get_opcodes_by_id(opcodes, n, ids[i],
-        static_bits, next);
+    uint16_t next_size = get_opcodes_by_id(opcodes, n, lane, ids[i],
+        static_bits.lanes[lane], next);
 
-    ind_fprintf(stdout, ind_str, ind_lvl, "case 0x%0*lX:%s\n",
-        indent_data.opcode_hex_width, ids[i],
-        next_size > 1 ? " {" : "");
+    ind_fprintf(stream, ind_str, ind_lvl, "case 0x%0*lX:%s\n",
+        hex_width, ids[i], next_size > 1 || wide ? " {" : "");
 
     if (next_size == 1) {
-      ind_fprintf(stdout, ind_str, ind_lvl + 1, "return %s;\n",
+      if (profile) {
+        ind_fprintf(stream, ind_str, ind_lvl + 1, "OPCODE_PROFILE_LEAF(%s);\n",
+            next[0].enum_str);
+      }
+      if (!wide) {
+        ind_fprintf(stream, ind_str, ind_lvl + 1, "return %s;\n",
+            next[0].enum_str);
+        continue;
+      }
+
+      ind_fprintf(stream, ind_str, ind_lvl + 1,
+          "OpcodeWide diff = (opcode & (OpcodeWide)%s) ^\n",
+          get_value_literal_str(get_fixed_bits(next[0], opcode_bits),
+            opcode_bits, hex_width).val);
+      ind_fprintf(stream, ind_str, ind_lvl + 3, "(OpcodeWide)%s;\n",
+          get_value_literal_str(next[0].oned_value, opcode_bits,
+            hex_width).val);
+      ind_fprintf(stream, ind_str, ind_lvl + 1,
+          "return (diff[0] | diff[1]) == 0 ? %s : INVALID_OP;\n",
           next[0].enum_str);
+      ind_fprintf(stream, ind_str, ind_lvl + 1, "}\n");
       continue;
     }
 
-    print_decoder_switch(ind_str, ind_lvl + 1, next, next_size, indent_data);
-    ind_fprintf(stdout, ind_str, ind_lvl  + 1, "} break;\n");
+    print_decoder_switch(stream, ind_str, ind_lvl + 1, next, next_size,
+        indent_data, profile, node_id);
+    ind_fprintf(stream, ind_str, ind_lvl  + 1, "} break;\n");
   }
 
-  ind_fprintf(stdout, ind_str, ind_lvl, "}\n");
+  ind_fprintf(stream, ind_str, ind_lvl, "}\n");
   return;
 }
 
+// What every switch print_decoder_switch() prints looks at, in the same order
+// and as it appears in the generated code. output needs room for n entries,
+// returns the number of switches.
+uint32_t get_decoder_nodes(const OpcodeData *opcodes, uint16_t n,
+    uint8_t opcode_bits, int hex_width, ShortString *output) {
+  OpcodeValue static_bits = get_static_bits(opcodes, n, opcode_bits);
+  uint8_t lane = get_switch_lane(opcodes, n, static_bits);
+  uint64_t ids[n];
+  uint32_t ids_size = get_ids(opcodes, n, lane, static_bits.lanes[lane], ids);
+  uint32_t count = 0;
+
+  output[count++] = opcode_bits > 64 ?
+    shortf("opcode[%u] & 0x%016lX", lane, static_bits.lanes[lane]) :
+    shortf("opcode & 0x%0*lX", hex_width, static_bits.lanes[lane]);
+  for (uint32_t i = 0; i < ids_size; i++) {
+    OpcodeData next[n];
+    uint16_t next_size = get_opcodes_by_id(opcodes, n, lane, ids[i],
+        static_bits.lanes[lane], next);
+
+    if (next_size > 1) {
+      count += get_decoder_nodes(next, next_size, opcode_bits, hex_width,
+          output + count);
+    }
+  }
+
+  return count;
+}
+
 bool check_for_collisions(const OpcodeData *opcodes, uint16_t n,
     IndentationData indent_data) {
   bool ret = false;
 
-  uint64_t static_bits = get_static_bits(opcodes, n, indent_data.opcode_width);
+  OpcodeValue static_bits = get_static_bits(opcodes, n,
+      indent_data.opcode_width);
+  uint8_t lane = get_switch_lane(opcodes, n, static_bits);
   uint64_t ids[n];
-  uint32_t ids_size = get_ids(opcodes, n, static_bits, ids);
+  uint32_t ids_size = get_ids(opcodes, n, lane, static_bits.lanes[lane], ids);
   
   assert(ids_size > 0 && "should not be posisble to get here and have no ids");
   for (uint32_t i = 0; i < ids_size; i++) {
     OpcodeData next[n];
-    int next_size = get_opcodes_by_id(opcodes, n, ids[i], static_bits, next);
+    int next_size = get_opcodes_by_id(opcodes, n, lane, ids[i],
+        static_bits.lanes[lane], next);
 
     if (next_size == n && memcmp(next, opcodes, next_size) == 0) {
         fprintf(stderr, "collision detected:\n");
@@ -336,6 +677,12 @@ OpcodenatorData init_opcodenator(OpcodeData *opcodes, uint16_t n,
     if (max_enum_str_len < strlen(opcodes[i].enum_str))
       max_enum_str_len = strlen(opcodes[i].enum_str);
   }
+
+  if (opcode_bits > MAX_OPCODE_BITS) {
+    fprintf(stderr, "opcodes can't be wider than %u bits: %u bits\n",
+        MAX_OPCODE_BITS, opcode_bits);
+    exit(1);
+  }
   
   for (size_t i = 0; i < n; i++) {
     opcodes[i].zeroed_value = get_zeroed(opcodes[i].opcode_str, opcode_bits);
@@ -371,26 +718,35 @@ OpcodenatorData init_opcodenator(OpcodeData *opcodes, uint16_t n,
     .function_prefix       = function_prefix,
     .indent_data           = indent_data,
     .decode_function_name = decode_function_name,
+    .stream                = stdout,
   };
 
   return ret;
 }
 
 
+// The enum is packed so it's stored as the smallest type that fits, the
+// static assert makes sure the compiler agrees with get_enum_type_str().
 void print_enum_declaration(OpcodenatorData d) {
-  ind_fprintf(stdout, d.indent_string, 0, "typedef enum {\n");
+  ind_fprintf(d.stream, d.indent_string, 0,
+      "typedef enum __attribute__ ((packed)) {\n");
   for (int i = 0; i < d.size; i++) {
-    ind_fprintf(stdout, d.indent_string, 1, "%s,\n", d.opcodes[i].enum_str);
+    ind_fprintf(d.stream, d.indent_string, 1, "%s,\n", d.opcodes[i].enum_str);
   }
-  ind_fprintf(stdout, d.indent_string, 1, "%s,\n", "INVALID_OP");
-  ind_fprintf(stdout, d.indent_string, 0, "} OpcodeType;\n");
+  ind_fprintf(d.stream, d.indent_string, 1, "%s,\n", "INVALID_OP");
+  ind_fprintf(d.stream, d.indent_string, 0, "} OpcodeType;\n");
+  ind_fprintf(d.stream, d.indent_string, 0,
+      "_Static_assert(sizeof(OpcodeType) == sizeof(%s), "
+      "\"OpcodeType is not backed by %s\");\n",
+      get_enum_type_str(d.size), get_enum_type_str(d.size));
 }
 
 void print_struct_declaration(OpcodenatorData d) {
-  ind_fprintf(stdout, d.indent_string, 0, "typedef struct {\n");
-  ind_fprintf(stdout, d.indent_string, 1, "char name[64];\n");
-  ind_fprintf(stdout, d.indent_string, 1, "void (*function)(uint64_t);\n");
-  ind_fprintf(stdout, d.indent_string, 0, "} OpcodeData;\n");
+  ind_fprintf(d.stream, d.indent_string, 0, "typedef struct {\n");
+  ind_fprintf(d.stream, d.indent_string, 1, "char name[64];\n");
+  ind_fprintf(d.stream, d.indent_string, 1, "void (*function)(%s);\n",
+      get_opcode_type_str(d.opcode_bits));
+  ind_fprintf(d.stream, d.indent_string, 0, "} OpcodeData;\n");
 }
 
 void print_function_declarations(OpcodenatorData d) {
@@ -399,8 +755,8 @@ void print_function_declarations(OpcodenatorData d) {
     for (int j = 0; j < function_name.len; j++) {
       function_name.val[j] = tolower(function_name.val[j]);
     }
-    fprintf(stdout, "void %s%s(uint64_t opcode);\n", d.function_prefix,
-        function_name.val); 
+    fprintf(d.stream, "void %s%s(%s opcode);\n", d.function_prefix,
+        function_name.val, get_opcode_type_str(d.opcode_bits));
   }
 }
 
@@ -410,13 +766,17 @@ void print_empty_function_definitions(OpcodenatorData d) {
     for (int j = 0; j < function_name.len; j++) {
       function_name.val[j] = tolower(function_name.val[j]);
     }
-    fprintf(stdout, "void %s%s(uint64_t) { }\n", d.function_prefix,
-        function_name.val); 
+    fprintf(d.stream, "void %s%s(%s) { }\n", d.function_prefix,
+        function_name.val, get_opcode_type_str(d.opcode_bits));
   }
 }
 
+void print_array_declaration(OpcodenatorData d) {
+  fprintf(d.stream, "extern OpcodeData opcodes[];\n");
+}
+
 void print_array_definition(OpcodenatorData d) {
-  ind_fprintf(stdout, d.indent_string, 0, "OpcodeData opcodes[] = {\n");
+  ind_fprintf(d.stream, d.indent_string, 0, "OpcodeData opcodes[] = {\n");
 
   for (int i = 0; i < d.size; i++) {
     ShortString function_name = shortf("op_%s", d.opcodes[i].enum_str);
@@ -426,7 +786,7 @@ void print_array_definition(OpcodenatorData d) {
 
     ShortString enum_in_brackets = shortf("[%s]", d.opcodes[i].enum_str);
     ShortString enum_in_quotes = shortf("\"%s\",", d.opcodes[i].enum_str);
-    ind_fprintf(stdout, d.indent_string, 1,
+    ind_fprintf(d.stream, d.indent_string, 1,
         "%-*s = { .name = %-*s .function = %-*s },\n",
         d.indent_data.enum_name_width + 2, enum_in_brackets.val,
         d.indent_data.enum_name_width + 3, enum_in_quotes.val,
@@ -434,18 +794,2578 @@ void print_array_definition(OpcodenatorData d) {
 
   }
 
-  ind_fprintf(stdout, d.indent_string, 0, "};\n");
+  ind_fprintf(d.stream, d.indent_string, 0, "};\n");
+}
+
+// Counters for the decoder printed with d.profile set. They are only compiled
+// in when OPCODE_DECODE_PROFILE is defined, otherwise the macros in the decoder
+// expand to nothing. Every thread counts into its own OpcodeProfile so there is
+// no sharing on the hot path, opcode_profile_dump() sums them up.
+void print_profile_declarations(OpcodenatorData d) {
+  const char *ind = d.indent_string;
+  ShortString *nodes = malloc(d.size * sizeof(ShortString));
+  assert(nodes != NULL);
+  uint32_t nodes_size = get_decoder_nodes(d.opcodes, d.size, d.opcode_bits,
+      d.indent_data.opcode_hex_width, nodes);
+
+  ind_fprintf(d.stream, ind, 0, "#ifdef OPCODE_DECODE_PROFILE\n");
+  ind_fprintf(d.stream, ind, 0, "#include <stdatomic.h>\n");
+  ind_fprintf(d.stream, ind, 0, "#include <stdio.h>\n");
+  ind_fprintf(d.stream, ind, 0, "#include <stdlib.h>\n");
+  fprintf(d.stream, "\n");
+  ind_fprintf(d.stream, ind, 0,
+      "#define OPCODE_PROFILE_NODES %u\n", nodes_size);
+  fprintf(d.stream, "\n");
+  ind_fprintf(d.stream, ind, 0, "typedef struct OpcodeProfile {\n");
+  ind_fprintf(d.stream, ind, 1, "uint64_t nodes[OPCODE_PROFILE_NODES];\n");
+  ind_fprintf(d.stream, ind, 1, "uint64_t leaves[INVALID_OP + 1];\n");
+  ind_fprintf(d.stream, ind, 1, "struct OpcodeProfile *next;\n");
+  ind_fprintf(d.stream, ind, 0, "} OpcodeProfile;\n");
+  fprintf(d.stream, "\n");
+  ind_fprintf(d.stream, ind, 0,
+      "_Atomic(OpcodeProfile *) opcode_profile_head;\n");
+  ind_fprintf(d.stream, ind, 0,
+      "_Thread_local OpcodeProfile *opcode_profile_local;\n");
+  fprintf(d.stream, "\n");
+  ind_fprintf(d.stream, ind, 0, "// Registers the calling thread's counters "
+      "on first use, they are never freed\n");
+  ind_fprintf(d.stream, ind, 0, "// so they can be dumped after the "
+      "thread exits.\n");
+  fprintf(d.stream, "OpcodeProfile *opcode_profile_get(void) {\n");
+  ind_fprintf(d.stream, ind, 1,
+      "OpcodeProfile *profile = opcode_profile_local;\n");
+  ind_fprintf(d.stream, ind, 1, "if (profile != NULL)\n");
+  ind_fprintf(d.stream, ind, 2, "return profile;\n");
+  fprintf(d.stream, "\n");
+  ind_fprintf(d.stream, ind, 1,
+      "profile = calloc(1, sizeof(OpcodeProfile));\n");
+  ind_fprintf(d.stream, ind, 1, "if (profile == NULL)\n");
+  ind_fprintf(d.stream, ind, 2, "abort();\n");
+  ind_fprintf(d.stream, ind, 1, "profile->next = atomic_load_explicit("
+      "&opcode_profile_head,\n");
+  ind_fprintf(d.stream, ind, 3, "memory_order_relaxed);\n");
+  ind_fprintf(d.stream, ind, 1, "while (!atomic_compare_exchange_weak_explicit("
+      "&opcode_profile_head,\n");
+  ind_fprintf(d.stream, ind, 3, "&profile->next, profile, "
+      "memory_order_release, memory_order_relaxed)) {\n");
+  ind_fprintf(d.stream, ind, 1, "}\n");
+  ind_fprintf(d.stream, ind, 1, "opcode_profile_local = profile;\n");
+  ind_fprintf(d.stream, ind, 1, "return profile;\n");
+  fprintf(d.stream, "}\n");
+  fprintf(d.stream, "\n");
+
+  ind_fprintf(d.stream, ind, 0, "// Writes one \"node <id> <count> <switch>\" "
+      "or \"leaf <name> <count>\" line per\n");
+  ind_fprintf(d.stream, ind, 0, "// counter that was hit. Call it once the "
+      "decoding threads are done.\n");
+  fprintf(d.stream, "int opcode_profile_dump(const char *path) {\n");
+  ind_fprintf(d.stream, ind, 1, "static const char *const leaf_names[] = {\n");
+  for (int i = 0; i < d.size; i++) {
+    ShortString enum_in_brackets = shortf("[%s]", d.opcodes[i].enum_str);
+    ind_fprintf(d.stream, ind, 2, "%-*s = \"%s\",\n",
+        d.indent_data.enum_name_width + 2, enum_in_brackets.val,
+        d.opcodes[i].enum_str);
+  }
+  ind_fprintf(d.stream, ind, 2, "%-*s = \"%s\",\n",
+      d.indent_data.enum_name_width + 2, "[INVALID_OP]", "INVALID_OP");
+  ind_fprintf(d.stream, ind, 1, "};\n");
+  ind_fprintf(d.stream, ind, 1,
+      "static const char *const node_names[OPCODE_PROFILE_NODES] = {\n");
+  for (uint32_t i = 0; i < nodes_size; i++) {
+    ind_fprintf(d.stream, ind, 2, "\"%s\",\n", nodes[i].val);
+  }
+  ind_fprintf(d.stream, ind, 1, "};\n");
+  free(nodes);
+  fprintf(d.stream, "\n");
+  ind_fprintf(d.stream, ind, 1, "FILE *f = fopen(path, \"w\");\n");
+  ind_fprintf(d.stream, ind, 1, "if (f == NULL)\n");
+  ind_fprintf(d.stream, ind, 2, "return -1;\n");
+  fprintf(d.stream, "\n");
+  ind_fprintf(d.stream, ind, 1, "OpcodeProfile *head = atomic_load_explicit("
+      "&opcode_profile_head,\n");
+  ind_fprintf(d.stream, ind, 3, "memory_order_acquire);\n");
+  ind_fprintf(d.stream, ind, 1,
+      "for (uint32_t i = 0; i < OPCODE_PROFILE_NODES; "
+      "i++) {\n");
+  ind_fprintf(d.stream, ind, 2, "unsigned long long count = 0;\n");
+  ind_fprintf(d.stream, ind, 2, "for (OpcodeProfile *p = head; p != NULL; "
+      "p = p->next) {\n");
+  ind_fprintf(d.stream, ind, 3, "count += p->nodes[i];\n");
+  ind_fprintf(d.stream, ind, 2, "}\n");
+  ind_fprintf(d.stream, ind, 2, "if (count > 0)\n");
+  ind_fprintf(d.stream, ind, 3,
+      "fprintf(f, \"node %%u %%llu %%s\\n\", i, count, "
+      "node_names[i]);\n");
+  ind_fprintf(d.stream, ind, 1, "}\n");
+  ind_fprintf(d.stream, ind, 1,
+      "for (uint32_t i = 0; i <= INVALID_OP; i++) {\n");
+  ind_fprintf(d.stream, ind, 2, "unsigned long long count = 0;\n");
+  ind_fprintf(d.stream, ind, 2, "for (OpcodeProfile *p = head; p != NULL; "
+      "p = p->next) {\n");
+  ind_fprintf(d.stream, ind, 3, "count += p->leaves[i];\n");
+  ind_fprintf(d.stream, ind, 2, "}\n");
+  ind_fprintf(d.stream, ind, 2, "if (count > 0)\n");
+  ind_fprintf(d.stream, ind, 3, "fprintf(f, \"leaf %%s %%llu\\n\", "
+      "leaf_names[i], count);\n");
+  ind_fprintf(d.stream, ind, 1, "}\n");
+  fprintf(d.stream, "\n");
+  ind_fprintf(d.stream, ind, 1, "return fclose(f) == 0 ? 0 : -1;\n");
+  fprintf(d.stream, "}\n");
+  fprintf(d.stream, "\n");
+
+  ind_fprintf(d.stream, ind, 0, "#define OPCODE_PROFILE_BEGIN() "
+      "OpcodeProfile *opcode_profile = opcode_profile_get()\n");
+  ind_fprintf(d.stream, ind, 0, "#define OPCODE_PROFILE_NODE(id) "
+      "(opcode_profile->nodes[id]++)\n");
+  ind_fprintf(d.stream, ind, 0, "#define OPCODE_PROFILE_LEAF(type) "
+      "(opcode_profile->leaves[type]++)\n");
+  ind_fprintf(d.stream, ind, 0, "#else\n");
+  ind_fprintf(d.stream, ind, 0, "#define OPCODE_PROFILE_BEGIN()\n");
+  ind_fprintf(d.stream, ind, 0, "#define OPCODE_PROFILE_NODE(id)\n");
+  ind_fprintf(d.stream, ind, 0, "#define OPCODE_PROFILE_LEAF(type)\n");
+  ind_fprintf(d.stream, ind, 0, "#endif // OPCODE_DECODE_PROFILE\n");
+}
+
+// Prototype of the decode function any of the backends emit, plus the profile
+// dump when the decoder is profiled.
+void print_decoder_declaration(OpcodenatorData d) {
+  fprintf(d.stream, "OpcodeType %s(%s opcode);\n", d.decode_function_name,
+      get_opcode_type_str(d.opcode_bits));
+  if (!d.profile)
+    return;
+
+  ind_fprintf(d.stream, d.indent_string, 0, "#ifdef OPCODE_DECODE_PROFILE\n");
+  ind_fprintf(d.stream, d.indent_string, 0,
+      "int opcode_profile_dump(const char *path);\n");
+  ind_fprintf(d.stream, d.indent_string, 0, "#endif\n");
 }
 
 void print_decoder_function(OpcodenatorData d) {
-  fprintf(stdout, "OpcodeType %s(uint64_t opcode) {\n", d.decode_function_name);
-  print_decoder_switch(d.indent_string, 1, d.opcodes, d.size, d.indent_data);
-  ind_fprintf(stdout, d.indent_string, 1, "return INVALID_OP;\n");
-  fprintf(stdout, "}\n");
+  uint32_t node_id = 0;
+
+  fprintf(d.stream, "OpcodeType %s(%s opcode) {\n", d.decode_function_name,
+      get_opcode_type_str(d.opcode_bits));
+  if (d.profile)
+    ind_fprintf(d.stream, d.indent_string, 1, "OPCODE_PROFILE_BEGIN();\n");
+  print_decoder_switch(d.stream, d.indent_string, 1, d.opcodes, d.size,
+      d.indent_data, d.profile, &node_id);
+  if (d.profile)
+    ind_fprintf(d.stream, d.indent_string, 1,
+        "OPCODE_PROFILE_LEAF(INVALID_OP);\n");
+  ind_fprintf(d.stream, d.indent_string, 1, "return INVALID_OP;\n");
+  fprintf(d.stream, "}\n");
 }
 
-void print_includes() {
-  fprintf(stdout, "#include <stdint.h>\n");
+// The nodes of one level of the branchless decoder's table chain. A node is
+// the set of opcodes still matching the bits looked at so far, as a bitset of
+// words uint64_ts, found through an open addressing hash of the sets.
+typedef struct {
+  uint32_t words;
+  uint64_t *sets;
+  uint32_t size;
+  uint32_t cap;
+  uint32_t *hash;
+  uint32_t hash_cap;
+} ChainLevel;
+
+uint32_t get_chain_set_hash(const uint64_t *set, uint32_t words) {
+  uint64_t hash = 0;
+  for (uint32_t i = 0; i < words; i++) {
+    hash = (hash ^ set[i]) * 0x9E3779B97F4A7C15;
+  }
+
+  return hash >> 32;
+}
+
+ChainLevel init_chain_level(uint32_t words) {
+  ChainLevel level = { .words = words, .cap = 16, .hash_cap = 64 };
+  level.sets = malloc(level.cap * words * sizeof(uint64_t));
+  level.hash = malloc(level.hash_cap * sizeof(uint32_t));
+  assert(level.sets != NULL && level.hash != NULL);
+  memset(level.hash, 0xFF, level.hash_cap * sizeof(uint32_t));
+  return level;
+}
+
+void free_chain_level(ChainLevel *level) {
+  free(level->sets);
+  free(level->hash);
+}
+
+// Index of set in level, adding it if it's not there yet.
+uint32_t add_chain_set(ChainLevel *level, const uint64_t *set) {
+  uint32_t words = level->words;
+  uint32_t slot = get_chain_set_hash(set, words) & (level->hash_cap - 1);
+  while (level->hash[slot] != UINT32_MAX) {
+    if (memcmp(level->sets + level->hash[slot] * words, set,
+          words * sizeof(uint64_t)) == 0)
+      return level->hash[slot];
+    slot = (slot + 1) & (level->hash_cap - 1);
+  }
+
+  if (level->size == level->cap) {
+    level->cap *= 2;
+    level->sets = realloc(level->sets,
+        level->cap * words * sizeof(uint64_t));
+    assert(level->sets != NULL);
+  }
+  memcpy(level->sets + level->size * words, set, words * sizeof(uint64_t));
+  level->hash[slot] = level->size;
+
+  if (++level->size * 2 > level->hash_cap) {
+    level->hash_cap *= 2;
+    level->hash = realloc(level->hash, level->hash_cap * sizeof(uint32_t));
+    assert(level->hash != NULL);
+    memset(level->hash, 0xFF, level->hash_cap * sizeof(uint32_t));
+    for (uint32_t i = 0; i < level->size; i++) {
+      slot = get_chain_set_hash(level->sets + i * words, words) &
+        (level->hash_cap - 1);
+      while (level->hash[slot] != UINT32_MAX) {
+        slot = (slot + 1) & (level->hash_cap - 1);
+      }
+      level->hash[slot] = i;
+    }
+  }
+
+  return level->size - 1;
+}
+
+uint64_t get_chunk(OpcodeValue value, uint8_t shift, uint8_t width) {
+  return (value.lanes[shift / 64] >> (shift % 64)) & ((1 << width) - 1);
+}
+
+bool has_fixed_bits_below(OpcodeData opcode, uint8_t opcode_bits,
+    uint8_t shift) {
+  OpcodeValue fixed = get_fixed_bits(opcode, opcode_bits);
+  for (int i = 0; i < OPCODE_LANES; i++) {
+    uint64_t below = i * 64 + 64 <= shift ? UINT64_MAX :
+      i * 64 < shift ? ((uint64_t)1 << (shift - i * 64)) - 1 : 0;
+    if (fixed.lanes[i] & below)
+      return true;
+  }
+
+  return false;
+}
+
+// Tables of the branchless decoder's chain: masks[] and bases[] per node in
+// level order, level l's nodes start at level_starts[l]. entries[] holds the
+// next level's node or, for the last level, the OpcodeType.
+typedef struct {
+  uint8_t levels;
+  uint32_t *level_starts;
+  uint32_t nodes_size;
+  uint8_t *masks;
+  uint32_t *bases;
+  uint32_t entries_size;
+  uint32_t *entries;
+} ChainTables;
+
+// Builds the tables of a fixed number of dependent table lookups, one per byte
+// of the opcode from the most significant one down (the first takes the
+// leftover bits when opcode_bits isn't a multiple of 8). Each lookup goes from
+// the set of opcodes matching the bits seen so far to the set matching one more
+// byte, and the last one gives the lowest matching index. A set whose lowest
+// opcode has no fixed bits left is already decided and its lookups ignore the
+// input.
+void build_chain_tables(OpcodenatorData d, ChainTables *tables) {
+  uint8_t levels = (d.opcode_bits + 7) / 8;
+  tables->levels = levels;
+  uint8_t first_width = d.opcode_bits - (levels - 1) * 8;
+  uint32_t words = (d.size + 63) / 64;
+  uint64_t set[words];
+
+  uint32_t nodes_size = 0;
+  uint32_t nodes_cap = 64;
+  uint8_t *masks = malloc(nodes_cap);
+  uint32_t *bases = malloc(nodes_cap * sizeof(uint32_t));
+  uint32_t entries_size = 0;
+  uint32_t entries_cap = 1024;
+  uint32_t *entries = malloc(entries_cap * sizeof(uint32_t));
+  uint32_t *level_starts = malloc((levels + 1) * sizeof(uint32_t));
+  assert(masks != NULL && bases != NULL && entries != NULL &&
+      level_starts != NULL);
+
+  memset(set, 0, sizeof(set));
+  for (int i = 0; i < d.size; i++) {
+    set[i / 64] |= (uint64_t)1 << (i % 64);
+  }
+  ChainLevel current = init_chain_level(words);
+  add_chain_set(&current, set);
+
+  for (uint8_t l = 0; l < levels; l++) {
+    uint8_t width = l == 0 ? first_width : 8;
+    uint8_t shift = (levels - 1 - l) * 8;
+    bool last = l + 1 == levels;
+    ChainLevel next = init_chain_level(words);
+    level_starts[l] = nodes_size;
+
+    for (uint32_t n = 0; n < current.size; n++) {
+      uint32_t children[256];
+      for (uint32_t chunk = 0; chunk < (1u << width); chunk++) {
+        memset(set, 0, sizeof(set));
+        int lowest = d.size;
+        for (int i = d.size - 1; i >= 0; i--) {
+          if (!(current.sets[n * words + i / 64] >> (i % 64) & 1))
+            continue;
+
+          OpcodeData opcode = d.opcodes[i];
+          uint64_t fixed = get_chunk(get_fixed_bits(opcode, d.opcode_bits),
+              shift, width);
+          if ((chunk & fixed) != get_chunk(opcode.oned_value, shift, width))
+            continue;
+
+          set[i / 64] |= (uint64_t)1 << (i % 64);
+          lowest = i;
+        }
+
+        if (lowest < d.size &&
+            !has_fixed_bits_below(d.opcodes[lowest], d.opcode_bits, shift)) {
+          memset(set, 0, sizeof(set));
+          set[lowest / 64] |= (uint64_t)1 << (lowest % 64);
+        }
+        children[chunk] = last ? (uint32_t)lowest : add_chain_set(&next, set);
+      }
+
+      bool same = true;
+      for (uint32_t chunk = 1; chunk < (1u << width); chunk++) {
+        same = same && children[chunk] == children[0];
+      }
+      uint32_t size = same ? 1 : 1u << width;
+
+      if (nodes_size == nodes_cap) {
+        nodes_cap *= 2;
+        masks = realloc(masks, nodes_cap);
+        bases = realloc(bases, nodes_cap * sizeof(uint32_t));
+        assert(masks != NULL && bases != NULL);
+      }
+      while (entries_size + size > entries_cap) {
+        entries_cap *= 2;
+        entries = realloc(entries, entries_cap * sizeof(uint32_t));
+        assert(entries != NULL);
+      }
+      masks[nodes_size] = same ? 0 : (1 << width) - 1;
+      bases[nodes_size++] = entries_size;
+      for (uint32_t i = 0; i < size; i++) {
+        entries[entries_size++] = children[i];
+      }
+    }
+
+    free_chain_level(&current);
+    current = next;
+  }
+  free_chain_level(&current);
+  level_starts[levels] = nodes_size;
+
+  // Node numbers are global, entries of level l point into level l + 1.
+  for (uint8_t l = 0; l + 1 < levels; l++) {
+    for (uint32_t n = level_starts[l]; n < level_starts[l + 1]; n++) {
+      uint32_t size = masks[n] == 0 ? 1 : masks[n] + 1;
+      for (uint32_t i = 0; i < size; i++) {
+        entries[bases[n] + i] += level_starts[l + 1];
+      }
+    }
+  }
+
+  tables->level_starts = level_starts;
+  tables->nodes_size = nodes_size;
+  tables->masks = masks;
+  tables->bases = bases;
+  tables->entries_size = entries_size;
+  tables->entries = entries;
+}
+
+void free_chain_tables(ChainTables *tables) {
+  free(tables->level_starts);
+  free(tables->masks);
+  free(tables->bases);
+  free(tables->entries);
+}
+
+uint32_t get_chain_entry_bytes(OpcodenatorData d, ChainTables tables) {
+  return tables.nodes_size <= UINT16_MAX && d.size < UINT16_MAX ? 2 : 4;
+}
+
+// Byte size of OpcodeChainNode, the blob has to be laid out exactly like it.
+#define CHAIN_NODE_BYTES 8
+
+void print_chain_types(OpcodenatorData d) {
+  ind_fprintf(d.stream, d.indent_string, 0, "typedef struct {\n");
+  ind_fprintf(d.stream, d.indent_string, 1, "uint32_t base;\n");
+  ind_fprintf(d.stream, d.indent_string, 1, "uint8_t mask;\n");
+  ind_fprintf(d.stream, d.indent_string, 0, "} OpcodeChainNode;\n");
+}
+
+// Tables of print_branchless_decoder_function(), as C definitions.
+void print_branchless_tables(OpcodenatorData d) {
+  const char *ind = d.indent_string;
+  ChainTables tables = { 0 };
+  build_chain_tables(d, &tables);
+
+  print_chain_types(d);
+  fprintf(d.stream, "\n");
+  ind_fprintf(d.stream, ind, 0,
+      "const OpcodeChainNode opcode_chain_nodes[%u] = {\n", tables.nodes_size);
+  for (uint8_t l = 0; l < tables.levels; l++) {
+    ind_fprintf(d.stream, ind, 1, "// level %u\n", l);
+    for (uint32_t n = tables.level_starts[l]; n < tables.level_starts[l + 1];
+        n++) {
+      ind_fprintf(d.stream, ind, 1, "{ %u, 0x%02X },\n", tables.bases[n],
+          tables.masks[n]);
+    }
+  }
+  ind_fprintf(d.stream, ind, 0, "};\n");
+  fprintf(d.stream, "\n");
+  ind_fprintf(d.stream, ind, 0, "const uint%u_t opcode_chain_entries[%u] = {\n",
+      get_chain_entry_bytes(d, tables) * 8, tables.entries_size);
+  for (uint32_t i = 0; i < tables.entries_size; i += 12) {
+    ind_fprintf(d.stream, ind, 1, "%s", "");
+    for (uint32_t j = i; j < tables.entries_size && j < i + 12; j++) {
+      fprintf(d.stream, "%u,%s", tables.entries[j],
+          j + 1 < tables.entries_size && j + 1 < i + 12 ? " " : "");
+    }
+    fprintf(d.stream, "\n");
+  }
+  ind_fprintf(d.stream, ind, 0, "};\n");
+
+  free_chain_tables(&tables);
+}
+
+// Decoder that walks the tables of build_chain_tables(), levels dependent
+// loads and no branches. Every fixed bit is checked, so unlike
+// print_decoder_function inputs that only match an opcode on its switched on
+// bits give INVALID_OP. Needs the output of print_branchless_tables() or
+// print_branchless_blob_declarations().
+void print_branchless_decoder_function(OpcodenatorData d) {
+  const char *ind = d.indent_string;
+  uint8_t levels = (d.opcode_bits + 7) / 8;
+
+  fprintf(d.stream, "OpcodeType %s(%s opcode) {\n", d.decode_function_name,
+      get_opcode_type_str(d.opcode_bits));
+  ind_fprintf(d.stream, ind, 1, "uint32_t node = 0;\n");
+  for (uint8_t l = 0; l < levels; l++) {
+    uint8_t shift = (levels - 1 - l) * 8;
+    ShortString lane = d.opcode_bits > 64 ? shortf("opcode[%u]", shift / 64) :
+      shortf("opcode");
+    ind_fprintf(d.stream, ind, 1, "node = opcode_chain_entries["
+        "opcode_chain_nodes[node].base +\n");
+    ind_fprintf(d.stream, ind, 3, "((%s >> %u) & "
+        "opcode_chain_nodes[node].mask)];\n", lane.val, shift % 64);
+  }
+  ind_fprintf(d.stream, ind, 1, "return (OpcodeType)node;\n");
+  fprintf(d.stream, "}\n");
+}
+
+// One level of the perfect hash decoder: the static bits of one lane are
+// hashed into a 1 << (64 - shift) entry table that starts at slots[base].
+typedef struct {
+  uint8_t lane;
+  uint64_t mask;
+  uint64_t multiplier;
+  uint8_t shift;
+  uint32_t base;
+} HashNode;
+
+typedef struct {
+  HashNode *nodes;
+  uint32_t nodes_size;
+  uint32_t *slots;
+  uint32_t slots_size;
+} HashTables;
+
+// Slots with this bit set point to another node, the rest hold an OpcodeType.
+uint32_t get_hash_child_bit(OpcodenatorData d) {
+  return d.size < 0x8000 ? 0x8000 : 0x80000000;
+}
+
+const char *get_hash_slot_type_str(OpcodenatorData d) {
+  return d.size < 0x8000 ? "uint16_t" : "uint32_t";
+}
+
+uint64_t splitmix64(uint64_t *state) {
+  uint64_t z = (*state += 0x9E3779B97F4A7C15);
+  z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9;
+  z = (z ^ (z >> 27)) * 0x94D049BB133111EB;
+  return z ^ (z >> 31);
+}
+
+// Looks for a multiplier that sends every id to its own slot, starting with the
+// smallest table that fits them and doubling it when too many multipliers fail.
+// The search is seeded with a constant so the output is reproducible. Returns
+// the number of table bits.
+uint8_t get_hash_multiplier(const uint64_t *ids, uint32_t n,
+    uint64_t *multiplier) {
+  uint64_t state = 0;
+  uint8_t bits = 1;
+  while (((uint32_t)1 << bits) < n) {
+    bits++;
+  }
+
+  for (; bits < 32; bits++) {
+    uint32_t table_size = (uint32_t)1 << bits;
+    bool *used = malloc(table_size * sizeof(bool));
+    assert(used != NULL);
+
+    for (int attempt = 0; attempt < 4096; attempt++) {
+      uint64_t m = splitmix64(&state) | 1;
+      bool ok = true;
+
+      memset(used, 0, table_size * sizeof(bool));
+      for (uint32_t i = 0; i < n && ok; i++) {
+        uint64_t slot = (ids[i] * m) >> (64 - bits);
+        ok = !used[slot];
+        used[slot] = true;
+      }
+
+      if (ok) {
+        free(used);
+        *multiplier = m;
+        return bits;
+      }
+    }
+
+    free(used);
+  }
+
+  assert(false && "no perfect hash found");
+  return 0;
+}
+
+// Builds the node for opcodes and, depth first, the nodes of every slot that
+// holds more than one opcode. Returns the index of the node.
+uint32_t build_hash_tables(OpcodenatorData d, const OpcodeData *opcodes,
+    uint16_t n, HashTables *tables) {
+  OpcodeValue static_bits = get_static_bits(opcodes, n, d.opcode_bits);
+  uint8_t lane = get_switch_lane(opcodes, n, static_bits);
+  uint64_t ids[n];
+  uint32_t ids_size = get_ids(opcodes, n, lane, static_bits.lanes[lane], ids);
+  uint64_t multiplier;
+  uint8_t bits = get_hash_multiplier(ids, ids_size, &multiplier);
+  uint32_t table_size = (uint32_t)1 << bits;
+
+  uint32_t node = tables->nodes_size++;
+  tables->nodes = realloc(tables->nodes, tables->nodes_size * sizeof(HashNode));
+  assert(tables->nodes != NULL);
+  uint32_t base = tables->slots_size;
+  tables->slots_size += table_size;
+  tables->slots = realloc(tables->slots, tables->slots_size * sizeof(uint32_t));
+  assert(tables->slots != NULL);
+
+  tables->nodes[node] = (HashNode) {
+    .lane       = lane,
+    .mask       = static_bits.lanes[lane],
+    .multiplier = multiplier,
+    .shift      = 64 - bits,
+    .base       = base,
+  };
+  for (uint32_t i = 0; i < table_size; i++) {
+    tables->slots[base + i] = d.size;
+  }
+
+  for (uint32_t i = 0; i < ids_size; i++) {
+    OpcodeData next[n];
+    uint16_t next_size = get_opcodes_by_id(opcodes, n, lane, ids[i],
+        static_bits.lanes[lane], next);
+    uint64_t slot = base + ((ids[i] * multiplier) >> (64 - bits));
+
+    if (next_size == 1) {
+      tables->slots[slot] = get_opcode_index(d, next[0].enum_str);
+      continue;
+    }
+
+    uint32_t child = build_hash_tables(d, next, next_size, tables);
+    tables->slots[slot] = get_hash_child_bit(d) | child;
+  }
+
+  return node;
+}
+
+void print_perfect_hash_types(OpcodenatorData d) {
+  const char *ind = d.indent_string;
+  const char *opcode_type = get_opcode_type_str(d.opcode_bits);
+
+  ind_fprintf(d.stream, ind, 0, "#define OPCODE_HASH_CHILD 0x%X\n",
+      get_hash_child_bit(d));
+  fprintf(d.stream, "\n");
+  ind_fprintf(d.stream, ind, 0, "typedef struct {\n");
+  ind_fprintf(d.stream, ind, 1, "uint64_t mask;\n");
+  ind_fprintf(d.stream, ind, 1, "uint64_t multiplier;\n");
+  ind_fprintf(d.stream, ind, 1, "uint32_t base;\n");
+  ind_fprintf(d.stream, ind, 1, "uint8_t shift;\n");
+  if (d.opcode_bits > 64)
+    ind_fprintf(d.stream, ind, 1, "uint8_t lane;\n");
+  ind_fprintf(d.stream, ind, 0, "} OpcodeHashNode;\n");
+  fprintf(d.stream, "\n");
+  ind_fprintf(d.stream, ind, 0, "typedef struct {\n");
+  ind_fprintf(d.stream, ind, 1, "%s mask;\n", opcode_type);
+  ind_fprintf(d.stream, ind, 1, "%s value;\n", opcode_type);
+  ind_fprintf(d.stream, ind, 0, "} OpcodeHashCheck;\n");
+}
+
+// Emits the tables print_perfect_hash_decoder_function() walks. Every node
+// hashes the static bits of its opcodes like a switch of
+// print_decoder_function() would look at them, the multipliers are searched
+// for here so that no two of them share a slot. Slots that no opcode hashes to
+// hold INVALID_OP, opcode_hash_checks[INVALID_OP] matches anything.
+void print_perfect_hash_tables(OpcodenatorData d) {
+  const char *ind = d.indent_string;
+  bool wide = d.opcode_bits > 64;
+  HashTables tables = { 0 };
+  build_hash_tables(d, d.opcodes, d.size, &tables);
+
+  print_perfect_hash_types(d);
+  fprintf(d.stream, "\n");
+
+  ind_fprintf(d.stream, ind, 0,
+      "const OpcodeHashNode opcode_hash_nodes[] = {\n");
+  for (uint32_t i = 0; i < tables.nodes_size; i++) {
+    HashNode node = tables.nodes[i];
+    ShortString lane = wide ? shortf(", .lane = %u", node.lane) :
+      shortf("%s", "");
+    ind_fprintf(d.stream, ind, 1, "{ .mask = 0x%016lX, .multiplier = 0x%016lX, "
+        ".base = %u, .shift = %u%s },\n", node.mask, node.multiplier,
+        node.base, node.shift, lane.val);
+  }
+  ind_fprintf(d.stream, ind, 0, "};\n");
+  fprintf(d.stream, "\n");
+
+  ind_fprintf(d.stream, ind, 0, "const %s opcode_hash_slots[] = {\n",
+      get_hash_slot_type_str(d));
+  for (uint32_t i = 0; i < tables.nodes_size; i++) {
+    HashNode node = tables.nodes[i];
+    uint32_t end = i + 1 < tables.nodes_size ? tables.nodes[i + 1].base :
+      tables.slots_size;
+
+    ind_fprintf(d.stream, ind, 1, "// node %u\n", i);
+    for (uint32_t j = node.base; j < end; j++) {
+      uint32_t slot = tables.slots[j];
+      if (slot & get_hash_child_bit(d)) {
+        ind_fprintf(d.stream, ind, 1, "OPCODE_HASH_CHILD | %u,\n",
+            slot & ~get_hash_child_bit(d));
+      } else {
+        ind_fprintf(d.stream, ind, 1, "%s,\n",
+            slot == d.size ? "INVALID_OP" : d.opcodes[slot].enum_str);
+      }
+    }
+  }
+  ind_fprintf(d.stream, ind, 0, "};\n");
+  fprintf(d.stream, "\n");
+
+  ind_fprintf(d.stream, ind, 0,
+      "const OpcodeHashCheck opcode_hash_checks[] = {\n");
+  for (int i = 0; i < d.size; i++) {
+    ShortString enum_in_brackets = shortf("[%s]", d.opcodes[i].enum_str);
+    ind_fprintf(d.stream, ind, 1, "%-*s = { .mask = %s, .value = %s },\n",
+        d.indent_data.enum_name_width + 2, enum_in_brackets.val,
+        get_value_literal_str(get_fixed_bits(d.opcodes[i], d.opcode_bits),
+          d.opcode_bits, d.indent_data.opcode_hex_width).val,
+        get_value_literal_str(d.opcodes[i].oned_value, d.opcode_bits,
+          d.indent_data.opcode_hex_width).val);
+  }
+  ind_fprintf(d.stream, ind, 1, "%-*s = { .mask = %s, .value = %s },\n",
+      d.indent_data.enum_name_width + 2, "[INVALID_OP]",
+      wide ? "{ 0, 0 }" : "0", wide ? "{ 0, 0 }" : "0");
+  ind_fprintf(d.stream, ind, 0, "};\n");
+
+  free(tables.nodes);
+  free(tables.slots);
+}
+
+// Byte sizes of the structs print_perfect_hash_types() emits, the blob has to
+// be laid out exactly like them.
+#define HASH_NODE_BYTES 24
+
+uint32_t get_hash_check_bytes(OpcodenatorData d) {
+  return get_opcode_type_bytes(d.opcode_bits) * 2;
+}
+
+uint32_t get_hash_slot_bytes(OpcodenatorData d) {
+  return d.size < 0x8000 ? 2 : 4;
+}
+
+void write_le(FILE *stream, uint64_t value, uint32_t bytes) {
+  for (uint32_t i = 0; i < bytes; i++) {
+    fputc(value >> (i * 8) & 0xFF, stream);
+  }
+}
+
+// Writes the tables print_perfect_hash_tables() would print as little endian
+// bytes, nodes then slots then checks. Meant to be built once into an object
+// with the output of print_perfect_hash_blob_assembly(), so big tables don't
+// have to go through the C compiler on every build.
+void write_perfect_hash_blob(OpcodenatorData d, FILE *blob) {
+  HashTables tables = { 0 };
+  build_hash_tables(d, d.opcodes, d.size, &tables);
+
+  for (uint32_t i = 0; i < tables.nodes_size; i++) {
+    HashNode node = tables.nodes[i];
+    write_le(blob, node.mask, 8);
+    write_le(blob, node.multiplier, 8);
+    write_le(blob, node.base, 4);
+    write_le(blob, node.shift, 1);
+    write_le(blob, d.opcode_bits > 64 ? node.lane : 0, 1);
+    write_le(blob, 0, HASH_NODE_BYTES - 22);
+  }
+
+  for (uint32_t i = 0; i < tables.slots_size; i++) {
+    write_le(blob, tables.slots[i], get_hash_slot_bytes(d));
+  }
+
+  uint32_t value_bytes = get_hash_check_bytes(d) / 2;
+  for (int i = 0; i <= d.size; i++) {
+    OpcodeValue mask = { { 0 } };
+    OpcodeValue value = { { 0 } };
+    if (i < d.size) {
+      mask = get_fixed_bits(d.opcodes[i], d.opcode_bits);
+      value = d.opcodes[i].oned_value;
+    }
+
+    for (uint32_t j = 0; j < value_bytes; j += 8) {
+      write_le(blob, mask.lanes[j / 8], value_bytes < 8 ? value_bytes : 8);
+    }
+    for (uint32_t j = 0; j < value_bytes; j += 8) {
+      write_le(blob, value.lanes[j / 8], value_bytes < 8 ? value_bytes : 8);
+    }
+  }
+
+  free(tables.nodes);
+  free(tables.slots);
+}
+
+// Declares the tables write_perfect_hash_blob() wrote instead of defining them.
+// The static asserts catch a target whose struct layout or byte order doesn't
+// match the blob.
+void print_perfect_hash_blob_declarations(OpcodenatorData d) {
+  const char *ind = d.indent_string;
+  HashTables tables = { 0 };
+  build_hash_tables(d, d.opcodes, d.size, &tables);
+
+  print_perfect_hash_types(d);
+  fprintf(d.stream, "\n");
+  ind_fprintf(d.stream, ind, 0,
+      "_Static_assert(__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__,\n");
+  ind_fprintf(d.stream, ind, 2,
+      "\"the opcode hash blob is little endian\");\n");
+  ind_fprintf(d.stream, ind, 0,
+      "_Static_assert(sizeof(OpcodeHashNode) == %u,\n", HASH_NODE_BYTES);
+  ind_fprintf(d.stream, ind, 2,
+      "\"OpcodeHashNode doesn't match the blob\");\n");
+  ind_fprintf(d.stream, ind, 0,
+      "_Static_assert(sizeof(OpcodeHashCheck) == %u,\n",
+      get_hash_check_bytes(d));
+  ind_fprintf(d.stream, ind, 2,
+      "\"OpcodeHashCheck doesn't match the blob\");\n");
+  fprintf(d.stream, "\n");
+  ind_fprintf(d.stream, ind, 0,
+      "extern const OpcodeHashNode opcode_hash_nodes[%u];\n",
+      tables.nodes_size);
+  ind_fprintf(d.stream, ind, 0, "extern const %s opcode_hash_slots[%u];\n",
+      get_hash_slot_type_str(d), tables.slots_size);
+  ind_fprintf(d.stream, ind, 0,
+      "extern const OpcodeHashCheck opcode_hash_checks[%u];\n", d.size + 1);
+
+  free(tables.nodes);
+  free(tables.slots);
+}
+
+void print_blob_symbol(OpcodenatorData d, const char *name,
+    const char *blob_path, uint32_t offset, uint32_t bytes) {
+  const char *ind = d.indent_string;
+
+  ind_fprintf(d.stream, ind, 1, ".globl %s\n", name);
+  ind_fprintf(d.stream, ind, 1, ".type %s, @object\n", name);
+  ind_fprintf(d.stream, ind, 1, ".size %s, %u\n", name, bytes);
+  ind_fprintf(d.stream, ind, 1, ".balign 16\n");
+  ind_fprintf(d.stream, ind, 0, "%s:\n", name);
+  ind_fprintf(d.stream, ind, 1, ".incbin \"%s\", %u, %u\n", blob_path, offset,
+      bytes);
+}
+
+// GNU assembler source (ELF targets) that gives every table in the blob at
+// blob_path the name print_perfect_hash_blob_declarations() declares.
+void print_perfect_hash_blob_assembly(OpcodenatorData d,
+    const char *blob_path) {
+  HashTables tables = { 0 };
+  build_hash_tables(d, d.opcodes, d.size, &tables);
+  uint32_t nodes_bytes = tables.nodes_size * HASH_NODE_BYTES;
+  uint32_t slots_bytes = tables.slots_size * get_hash_slot_bytes(d);
+  uint32_t checks_bytes = (d.size + 1) * get_hash_check_bytes(d);
+
+  ind_fprintf(d.stream, d.indent_string, 1, ".section .rodata\n");
+  print_blob_symbol(d, "opcode_hash_nodes", blob_path, 0, nodes_bytes);
+  print_blob_symbol(d, "opcode_hash_slots", blob_path, nodes_bytes,
+      slots_bytes);
+  print_blob_symbol(d, "opcode_hash_checks", blob_path,
+      nodes_bytes + slots_bytes, checks_bytes);
+  fprintf(d.stream, "\n");
+  ind_fprintf(d.stream, d.indent_string, 1,
+      ".section .note.GNU-stack, \"\", @progbits\n");
+
+  free(tables.nodes);
+  free(tables.slots);
+}
+
+// Same result as print_branchless_decoder_function, every level is one
+// multiply and one table load instead of a switch. Only the opcode that is
+// found is checked against the input, which also catches inputs that hashed to
+// a slot they don't belong to. Needs the output of print_perfect_hash_tables().
+void print_perfect_hash_decoder_function(OpcodenatorData d) {
+  const char *ind = d.indent_string;
+
+  fprintf(d.stream, "OpcodeType %s(%s opcode) {\n", d.decode_function_name,
+      get_opcode_type_str(d.opcode_bits));
+  ind_fprintf(d.stream, ind, 1,
+      "const OpcodeHashNode *node = &opcode_hash_nodes[0];\n");
+  ind_fprintf(d.stream, ind, 1, "%s slot;\n", get_hash_slot_type_str(d));
+  ind_fprintf(d.stream, ind, 1, "for (;;) {\n");
+  ind_fprintf(d.stream, ind, 2, "uint64_t key = %s & node->mask;\n",
+      d.opcode_bits > 64 ? "opcode[node->lane]" : "opcode");
+  ind_fprintf(d.stream, ind, 2, "slot = opcode_hash_slots[node->base + "
+      "(key * node->multiplier >> node->shift)];\n");
+  ind_fprintf(d.stream, ind, 2, "if (!(slot & OPCODE_HASH_CHILD))\n");
+  ind_fprintf(d.stream, ind, 3, "break;\n");
+  ind_fprintf(d.stream, ind, 2,
+      "node = &opcode_hash_nodes[slot & ~OPCODE_HASH_CHILD];\n");
+  ind_fprintf(d.stream, ind, 1, "}\n");
+  fprintf(d.stream, "\n");
+  ind_fprintf(d.stream, ind, 1,
+      "const OpcodeHashCheck *check = &opcode_hash_checks[slot];\n");
+  if (d.opcode_bits > 64) {
+    ind_fprintf(d.stream, ind, 1,
+        "OpcodeWide diff = (opcode & check->mask) ^ check->value;\n");
+    ind_fprintf(d.stream, ind, 1,
+        "return (diff[0] | diff[1]) == 0 ? (OpcodeType)slot : INVALID_OP;\n");
+  } else {
+    ind_fprintf(d.stream, ind, 1,
+        "return (opcode & check->mask) == check->value ?"
+        " (OpcodeType)slot : INVALID_OP;\n");
+  }
+  fprintf(d.stream, "}\n");
+}
+
+// Prints the OpcodeTypes in types, d.size standing for INVALID_OP, as rows of
+// 8 for tables too long for one entry per line.
+void print_enum_rows(OpcodenatorData d, const uint16_t *types, uint32_t n) {
+  for (uint32_t i = 0; i < n; i += 8) {
+    ind_fprintf(d.stream, d.indent_string, 1, "%s", "");
+    for (uint32_t j = i; j < n && j < i + 8; j++) {
+      fprintf(d.stream, "%s,%s", types[j] == d.size ? "INVALID_OP" :
+          d.opcodes[types[j]].enum_str, j + 1 < n && j + 1 < i + 8 ? " " : "");
+    }
+    fprintf(d.stream, "\n");
+  }
+}
+
+// Whether opcode can be an input whose top table_bits bits are index.
+bool opcode_matches_index(OpcodeData opcode, uint8_t opcode_bits,
+    uint8_t table_bits, uint64_t index) {
+  uint8_t shift = opcode_bits - table_bits;
+  uint64_t fixed = get_fixed_bits(opcode, opcode_bits).lanes[0] >> shift;
+  return ((index ^ (opcode.oned_value.lanes[0] >> shift)) & fixed) == 0;
+}
+
+// The opcodes every entry of a table on the top table_bits bits of the opcode
+// can be, entry i lists candidates[offsets[i]] to candidates[offsets[i + 1]].
+// When table_bits covers every bit, shift is 0 and every entry lists exactly
+// one, d.size standing for INVALID_OP.
+typedef struct {
+  uint32_t entries;
+  uint8_t shift;
+  uint32_t *offsets;
+  uint16_t *candidates;
+  uint32_t candidates_size;
+} TableIndex;
+
+TableIndex build_table_index(OpcodenatorData d, uint8_t table_bits) {
+  if (d.opcode_bits > 64 || table_bits == 0 || table_bits > MAX_TABLE_BITS ||
+      table_bits > d.opcode_bits) {
+    fprintf(stderr, "can't index %u bit opcodes with a %u bit table, "
+        "tables take 1 to %u bits of opcodes up to 64 bits\n",
+        d.opcode_bits, table_bits, MAX_TABLE_BITS);
+    exit(1);
+  }
+
+  TableIndex table = { 0 };
+  table.entries = (uint32_t)1 << table_bits;
+  table.shift = d.opcode_bits - table_bits;
+  uint32_t candidates_cap = table.entries;
+  table.candidates = malloc(candidates_cap * sizeof(uint16_t));
+  table.offsets = malloc((table.entries + 1) * sizeof(uint32_t));
+  assert(table.candidates != NULL && table.offsets != NULL);
+
+  for (uint32_t i = 0; i < table.entries; i++) {
+    table.offsets[i] = table.candidates_size;
+    for (uint16_t j = 0; j < d.size; j++) {
+      if (!opcode_matches_index(d.opcodes[j], d.opcode_bits, table_bits, i))
+        continue;
+
+      if (table.candidates_size == candidates_cap) {
+        candidates_cap *= 2;
+        table.candidates = realloc(table.candidates,
+            candidates_cap * sizeof(uint16_t));
+        assert(table.candidates != NULL);
+      }
+      table.candidates[table.candidates_size++] = j;
+      if (table.shift == 0)
+        break;
+    }
+
+    if (table.shift == 0 && table.candidates_size == table.offsets[i])
+      table.candidates[table.candidates_size++] = d.size;
+  }
+  table.offsets[table.entries] = table.candidates_size;
+
+  return table;
+}
+
+void free_table_index(TableIndex *table) {
+  free(table->offsets);
+  free(table->candidates);
+}
+
+uint32_t get_table_offset_bytes(TableIndex table) {
+  return table.candidates_size <= UINT16_MAX ? 2 : 4;
+}
+
+void print_table_types(OpcodenatorData d) {
+  const char *ind = d.indent_string;
+  const char *opcode_type = get_opcode_type_str(d.opcode_bits);
+
+  ind_fprintf(d.stream, ind, 0, "typedef struct {\n");
+  ind_fprintf(d.stream, ind, 1, "%s mask;\n", opcode_type);
+  ind_fprintf(d.stream, ind, 1, "%s value;\n", opcode_type);
+  ind_fprintf(d.stream, ind, 0, "} OpcodeTableCheck;\n");
+}
+
+// Tables of print_table_decoder_function(), as C definitions.
+void print_table_tables(OpcodenatorData d, uint8_t table_bits) {
+  const char *ind = d.indent_string;
+  TableIndex table = build_table_index(d, table_bits);
+
+  if (table.shift == 0) {
+    ind_fprintf(d.stream, ind, 0, "const OpcodeType opcode_table[%u] = {\n",
+        table.entries);
+    print_enum_rows(d, table.candidates, table.candidates_size);
+    ind_fprintf(d.stream, ind, 0, "};\n");
+
+    free_table_index(&table);
+    return;
+  }
+
+  print_table_types(d);
+  fprintf(d.stream, "\n");
+
+  ind_fprintf(d.stream, ind, 0,
+      "const OpcodeTableCheck opcode_table_checks[] = {\n");
+  for (int i = 0; i < d.size; i++) {
+    ShortString enum_in_brackets = shortf("[%s]", d.opcodes[i].enum_str);
+    ind_fprintf(d.stream, ind, 1, "%-*s = { .mask = %s, .value = %s },\n",
+        d.indent_data.enum_name_width + 2, enum_in_brackets.val,
+        get_value_literal_str(get_fixed_bits(d.opcodes[i], d.opcode_bits),
+          d.opcode_bits, d.indent_data.opcode_hex_width).val,
+        get_value_literal_str(d.opcodes[i].oned_value, d.opcode_bits,
+          d.indent_data.opcode_hex_width).val);
+  }
+  ind_fprintf(d.stream, ind, 0, "};\n");
+  fprintf(d.stream, "\n");
+
+  ind_fprintf(d.stream, ind, 0, "const uint%u_t opcode_table_offsets[%u] = {\n",
+      get_table_offset_bytes(table) * 8, table.entries + 1);
+  for (uint32_t i = 0; i <= table.entries; i += 8) {
+    ind_fprintf(d.stream, ind, 1, "%s", "");
+    for (uint32_t j = i; j <= table.entries && j < i + 8; j++) {
+      fprintf(d.stream, "%u,%s", table.offsets[j],
+          j + 1 <= table.entries && j + 1 < i + 8 ? " " : "");
+    }
+    fprintf(d.stream, "\n");
+  }
+  ind_fprintf(d.stream, ind, 0, "};\n");
+  fprintf(d.stream, "\n");
+
+  ind_fprintf(d.stream, ind, 0, "const OpcodeType opcode_table_candidates[%u] "
+      "= {\n", table.candidates_size);
+  print_enum_rows(d, table.candidates, table.candidates_size);
+  ind_fprintf(d.stream, ind, 0, "};\n");
+
+  free_table_index(&table);
+}
+
+// Writes the tables print_table_tables() would print as little endian bytes,
+// checks then offsets then candidates, or only the flat table. Built the same
+// way as write_perfect_hash_blob(), with print_table_blob_assembly().
+void write_table_blob(OpcodenatorData d, uint8_t table_bits, FILE *blob) {
+  TableIndex table = build_table_index(d, table_bits);
+  uint32_t enum_bytes = d.size <= UINT8_MAX ? 1 : 2;
+
+  if (table.shift != 0) {
+    uint32_t value_bytes = get_opcode_type_bytes(d.opcode_bits);
+    for (int i = 0; i < d.size; i++) {
+      write_le(blob, get_fixed_bits(d.opcodes[i], d.opcode_bits).lanes[0],
+          value_bytes);
+      write_le(blob, d.opcodes[i].oned_value.lanes[0], value_bytes);
+    }
+    for (uint32_t i = 0; i <= table.entries; i++) {
+      write_le(blob, table.offsets[i], get_table_offset_bytes(table));
+    }
+  }
+  for (uint32_t i = 0; i < table.candidates_size; i++) {
+    write_le(blob, table.candidates[i], enum_bytes);
+  }
+
+  free_table_index(&table);
+}
+
+// Declares the tables write_table_blob() wrote instead of defining them.
+void print_table_blob_declarations(OpcodenatorData d, uint8_t table_bits) {
+  const char *ind = d.indent_string;
+  TableIndex table = build_table_index(d, table_bits);
+
+  ind_fprintf(d.stream, ind, 0,
+      "_Static_assert(__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__,\n");
+  ind_fprintf(d.stream, ind, 2,
+      "\"the opcode table blob is little endian\");\n");
+  if (table.shift == 0) {
+    ind_fprintf(d.stream, ind, 0, "extern const OpcodeType opcode_table[%u];\n",
+        table.entries);
+
+    free_table_index(&table);
+    return;
+  }
+
+  fprintf(d.stream, "\n");
+  print_table_types(d);
+  fprintf(d.stream, "\n");
+  ind_fprintf(d.stream, ind, 0,
+      "_Static_assert(sizeof(OpcodeTableCheck) == %u,\n",
+      get_opcode_type_bytes(d.opcode_bits) * 2);
+  ind_fprintf(d.stream, ind, 2,
+      "\"OpcodeTableCheck doesn't match the blob\");\n");
+  fprintf(d.stream, "\n");
+  ind_fprintf(d.stream, ind, 0,
+      "extern const OpcodeTableCheck opcode_table_checks[%u];\n", d.size);
+  ind_fprintf(d.stream, ind, 0,
+      "extern const uint%u_t opcode_table_offsets[%u];\n",
+      get_table_offset_bytes(table) * 8, table.entries + 1);
+  ind_fprintf(d.stream, ind, 0,
+      "extern const OpcodeType opcode_table_candidates[%u];\n",
+      table.candidates_size);
+
+  free_table_index(&table);
+}
+
+// GNU assembler source (ELF targets) that gives every table in the blob at
+// blob_path the name print_table_blob_declarations() declares.
+void print_table_blob_assembly(OpcodenatorData d, uint8_t table_bits,
+    const char *blob_path) {
+  TableIndex table = build_table_index(d, table_bits);
+  uint32_t checks_bytes = table.shift == 0 ? 0 :
+    d.size * get_opcode_type_bytes(d.opcode_bits) * 2;
+  uint32_t offsets_bytes = table.shift == 0 ? 0 :
+    (table.entries + 1) * get_table_offset_bytes(table);
+  uint32_t candidates_bytes = table.candidates_size *
+    (d.size <= UINT8_MAX ? 1 : 2);
+
+  ind_fprintf(d.stream, d.indent_string, 1, ".section .rodata\n");
+  if (table.shift == 0) {
+    print_blob_symbol(d, "opcode_table", blob_path, 0, candidates_bytes);
+  } else {
+    print_blob_symbol(d, "opcode_table_checks", blob_path, 0, checks_bytes);
+    print_blob_symbol(d, "opcode_table_offsets", blob_path, checks_bytes,
+        offsets_bytes);
+    print_blob_symbol(d, "opcode_table_candidates", blob_path,
+        checks_bytes + offsets_bytes, candidates_bytes);
+  }
+  fprintf(d.stream, "\n");
+  ind_fprintf(d.stream, d.indent_string, 1,
+      ".section .note.GNU-stack, \"\", @progbits\n");
+
+  free_table_index(&table);
+}
+
+// Decoder indexed by the top table_bits bits of the opcode. Every entry lists
+// the opcodes that can start with those bits and they are checked in order, so
+// the result is the same as print_branchless_decoder_function's. When
+// table_bits covers every bit that list is never longer than one and the table
+// holds the result directly, a flat table. Needs the output of
+// print_table_tables() or print_table_blob_declarations().
+void print_table_decoder_function(OpcodenatorData d, uint8_t table_bits) {
+  const char *ind = d.indent_string;
+  const char *opcode_type = get_opcode_type_str(d.opcode_bits);
+  TableIndex table = build_table_index(d, table_bits);
+
+  fprintf(d.stream, "OpcodeType %s(%s opcode) {\n", d.decode_function_name,
+      opcode_type);
+  if (table.shift == 0) {
+    ind_fprintf(d.stream, ind, 1, "return opcode_table[opcode];\n");
+    fprintf(d.stream, "}\n");
+
+    free_table_index(&table);
+    return;
+  }
+
+  ind_fprintf(d.stream, ind, 1, "uint32_t index = opcode >> %u;\n",
+      table.shift);
+  ind_fprintf(d.stream, ind, 1, "for (uint32_t i = opcode_table_offsets[index];"
+      "\n");
+  ind_fprintf(d.stream, ind, 3,
+      "i < opcode_table_offsets[index + 1]; i++) {\n");
+  ind_fprintf(d.stream, ind, 2,
+      "OpcodeType type = opcode_table_candidates[i];\n");
+  ind_fprintf(d.stream, ind, 2, "if ((opcode & opcode_table_checks[type].mask) "
+      "==\n");
+  ind_fprintf(d.stream, ind, 4, "opcode_table_checks[type].value)\n");
+  ind_fprintf(d.stream, ind, 3, "return type;\n");
+  ind_fprintf(d.stream, ind, 1, "}\n");
+  ind_fprintf(d.stream, ind, 1, "return INVALID_OP;\n");
+  fprintf(d.stream, "}\n");
+
+  free_table_index(&table);
+}
+
+// Writes the tables print_branchless_tables() would print as little endian
+// bytes, nodes then entries. Built the same way as write_perfect_hash_blob(),
+// with print_branchless_blob_assembly().
+void write_branchless_blob(OpcodenatorData d, FILE *blob) {
+  ChainTables tables = { 0 };
+  build_chain_tables(d, &tables);
+
+  for (uint32_t i = 0; i < tables.nodes_size; i++) {
+    write_le(blob, tables.bases[i], 4);
+    write_le(blob, tables.masks[i], 1);
+    write_le(blob, 0, CHAIN_NODE_BYTES - 5);
+  }
+  for (uint32_t i = 0; i < tables.entries_size; i++) {
+    write_le(blob, tables.entries[i], get_chain_entry_bytes(d, tables));
+  }
+
+  free_chain_tables(&tables);
+}
+
+// Declares the tables write_branchless_blob() wrote instead of defining them.
+void print_branchless_blob_declarations(OpcodenatorData d) {
+  const char *ind = d.indent_string;
+  ChainTables tables = { 0 };
+  build_chain_tables(d, &tables);
+
+  print_chain_types(d);
+  fprintf(d.stream, "\n");
+  ind_fprintf(d.stream, ind, 0,
+      "_Static_assert(__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__,\n");
+  ind_fprintf(d.stream, ind, 2,
+      "\"the opcode chain blob is little endian\");\n");
+  ind_fprintf(d.stream, ind, 0,
+      "_Static_assert(sizeof(OpcodeChainNode) == %u,\n", CHAIN_NODE_BYTES);
+  ind_fprintf(d.stream, ind, 2,
+      "\"OpcodeChainNode doesn't match the blob\");\n");
+  fprintf(d.stream, "\n");
+  ind_fprintf(d.stream, ind, 0,
+      "extern const OpcodeChainNode opcode_chain_nodes[%u];\n",
+      tables.nodes_size);
+  ind_fprintf(d.stream, ind, 0,
+      "extern const uint%u_t opcode_chain_entries[%u];\n",
+      get_chain_entry_bytes(d, tables) * 8, tables.entries_size);
+
+  free_chain_tables(&tables);
+}
+
+// GNU assembler source (ELF targets) that gives every table in the blob at
+// blob_path the name print_branchless_blob_declarations() declares.
+void print_branchless_blob_assembly(OpcodenatorData d,
+    const char *blob_path) {
+  ChainTables tables = { 0 };
+  build_chain_tables(d, &tables);
+  uint32_t nodes_bytes = tables.nodes_size * CHAIN_NODE_BYTES;
+  uint32_t entries_bytes = tables.entries_size *
+    get_chain_entry_bytes(d, tables);
+
+  ind_fprintf(d.stream, d.indent_string, 1, ".section .rodata\n");
+  print_blob_symbol(d, "opcode_chain_nodes", blob_path, 0, nodes_bytes);
+  print_blob_symbol(d, "opcode_chain_entries", blob_path, nodes_bytes,
+      entries_bytes);
+  fprintf(d.stream, "\n");
+  ind_fprintf(d.stream, d.indent_string, 1,
+      ".section .note.GNU-stack, \"\", @progbits\n");
+
+  free_chain_tables(&tables);
+}
+
+ShortString get_variant_name(OpcodenatorData d, DecoderVariant variant) {
+  switch (variant.backend) {
+  case BACKEND_SWITCH:
+    return shortf("switch");
+  case BACKEND_BRANCHLESS:
+    return shortf("branchless");
+  case BACKEND_PERFECT_HASH:
+    return shortf("perfect_hash");
+  case BACKEND_TABLE:
+    if (variant.table_bits == d.opcode_bits)
+      return shortf("flat_table");
+    return shortf("table_%u", variant.table_bits);
+  }
+
+  assert(false && "unknown backend");
+  return shortf("unknown");
+}
+
+// Everything the decode function of the variant needs and the function itself.
+// The switch decoder gets its profile declarations when d.profile is set.
+void print_decoder_variant(OpcodenatorData d, DecoderVariant variant) {
+  switch (variant.backend) {
+  case BACKEND_SWITCH:
+    if (d.profile) {
+      print_profile_declarations(d);
+      fprintf(d.stream, "\n");
+    }
+    print_decoder_function(d);
+    break;
+  case BACKEND_BRANCHLESS:
+    print_branchless_tables(d);
+    fprintf(d.stream, "\n");
+    print_branchless_decoder_function(d);
+    break;
+  case BACKEND_PERFECT_HASH:
+    print_perfect_hash_tables(d);
+    fprintf(d.stream, "\n");
+    print_perfect_hash_decoder_function(d);
+    break;
+  case BACKEND_TABLE:
+    print_table_tables(d, variant.table_bits);
+    fprintf(d.stream, "\n");
+    print_table_decoder_function(d, variant.table_bits);
+    break;
+  }
+}
+
+// Whether the tables of the variant can go in a blob, only the switch decoder
+// has none.
+bool variant_has_blob(DecoderVariant variant) {
+  return variant.backend != BACKEND_SWITCH;
+}
+
+void write_decoder_blob(OpcodenatorData d, DecoderVariant variant,
+    FILE *blob) {
+  assert(variant_has_blob(variant) && "variant has no blob");
+  if (variant.backend == BACKEND_BRANCHLESS)
+    write_branchless_blob(d, blob);
+  else if (variant.backend == BACKEND_PERFECT_HASH)
+    write_perfect_hash_blob(d, blob);
+  else
+    write_table_blob(d, variant.table_bits, blob);
+}
+
+// Same as print_decoder_variant(), but the tables are only declared, they are
+// expected to be written with write_decoder_blob().
+void print_decoder_blob_variant(OpcodenatorData d, DecoderVariant variant) {
+  assert(variant_has_blob(variant) && "variant has no blob");
+  if (variant.backend == BACKEND_BRANCHLESS) {
+    print_branchless_blob_declarations(d);
+    fprintf(d.stream, "\n");
+    print_branchless_decoder_function(d);
+  } else if (variant.backend == BACKEND_PERFECT_HASH) {
+    print_perfect_hash_blob_declarations(d);
+    fprintf(d.stream, "\n");
+    print_perfect_hash_decoder_function(d);
+  } else {
+    print_table_blob_declarations(d, variant.table_bits);
+    fprintf(d.stream, "\n");
+    print_table_decoder_function(d, variant.table_bits);
+  }
+}
+
+// The assembler looks for blob_path in the directory it runs in and then in
+// every -I directory, so the blob's file name with -Wa,-I<its directory>
+// assembles from anywhere.
+void print_decoder_blob_assembly(OpcodenatorData d, DecoderVariant variant,
+    const char *blob_path) {
+  assert(variant_has_blob(variant) && "variant has no blob");
+  if (variant.backend == BACKEND_BRANCHLESS)
+    print_branchless_blob_assembly(d, blob_path);
+  else if (variant.backend == BACKEND_PERFECT_HASH)
+    print_perfect_hash_blob_assembly(d, blob_path);
+  else
+    print_table_blob_assembly(d, variant.table_bits, blob_path);
+}
+
+// Every opcode with random operand bits, shuffled so the benchmark doesn't
+// just measure the branch predictor. The seed is constant so runs compare.
+uint64_t *get_sample_workload(OpcodenatorData d, size_t *size) {
+  const uint32_t per_opcode = 64;
+  uint64_t state = 0;
+  *size = (size_t)d.size * per_opcode;
+  uint64_t *workload = malloc(*size * sizeof(uint64_t));
+  assert(workload != NULL);
+
+  for (size_t i = 0; i < *size; i++) {
+    OpcodeData opcode = d.opcodes[i / per_opcode];
+    uint64_t operands = ~get_fixed_bits(opcode, d.opcode_bits).lanes[0] &
+      get_opcode_mask(d.opcode_bits).lanes[0];
+    workload[i] = opcode.oned_value.lanes[0] | (splitmix64(&state) & operands);
+  }
+  for (size_t i = *size - 1; i > 0; i--) {
+    size_t j = splitmix64(&state) % (i + 1);
+    uint64_t tmp = workload[i];
+    workload[i] = workload[j];
+    workload[j] = tmp;
+  }
+
+  return workload;
+}
+
+// Reads a workload for autotune_decoder() from path, a file of opcodes as 8
+// byte little endian words, the way the benchmarks read it. Exits if it can't
+// be read or holds no opcode.
+uint64_t *read_workload(const char *path, size_t *size) {
+  FILE *f = fopen(path, "rb");
+  if (f == NULL) {
+    fprintf(stderr, "can't open workload %s\n", path);
+    exit(1);
+  }
+  fseek(f, 0, SEEK_END);
+  long bytes = ftell(f);
+  fseek(f, 0, SEEK_SET);
+  *size = bytes > 0 ? (size_t)bytes / 8 : 0;
+  if (*size == 0) {
+    fprintf(stderr, "workload %s holds no opcode\n", path);
+    exit(1);
+  }
+
+  uint64_t *workload = malloc(*size * sizeof(uint64_t));
+  assert(workload != NULL);
+  for (size_t i = 0; i < *size; i++) {
+    uint8_t le[8];
+    if (fread(le, 1, 8, f) != 8) {
+      fprintf(stderr, "can't read workload %s\n", path);
+      exit(1);
+    }
+    workload[i] = 0;
+    for (int j = 0; j < 8; j++) {
+      workload[i] |= (uint64_t)le[j] << (j * 8);
+    }
+  }
+  fclose(f);
+
+  return workload;
+}
+
+// What the decoders that check every fixed bit return for value, the first
+// opcode it matches or d.size for INVALID_OP.
+uint16_t get_reference_type(OpcodenatorData d, uint64_t value) {
+  for (uint16_t i = 0; i < d.size; i++) {
+    uint64_t fixed = get_fixed_bits(d.opcodes[i], d.opcode_bits).lanes[0];
+    if ((value & fixed) == d.opcodes[i].oned_value.lanes[0])
+      return i;
+  }
+
+  return d.size;
+}
+
+// Checksum of the types the workload decodes to, in order. The benchmark main
+// prints the same one for what its decoder returned.
+uint32_t get_workload_checksum(OpcodenatorData d, const uint64_t *workload,
+    size_t size) {
+  uint32_t checksum = 0;
+  for (size_t i = 0; i < size; i++) {
+    checksum = checksum * 31 + get_reference_type(d, workload[i]);
+  }
+
+  return checksum;
+}
+
+// The main() of a benchmark. It reads the whole workload, pins itself to the
+// cpu it's on and prints the best time per decode out of a few runs, then the
+// checksum of the types it decoded like get_workload_checksum().
+void print_benchmark_main(OpcodenatorData d) {
+  const char *ind = d.indent_string;
+
+  fprintf(d.stream, "int main(int argc, char **argv) {\n");
+  ind_fprintf(d.stream, ind, 1, "FILE *f = argc > 1 ? fopen(argv[1], \"rb\") "
+      ": NULL;\n");
+  ind_fprintf(d.stream, ind, 1, "if (f == NULL)\n");
+  ind_fprintf(d.stream, ind, 2, "return 1;\n");
+  ind_fprintf(d.stream, ind, 1, "fseek(f, 0, SEEK_END);\n");
+  ind_fprintf(d.stream, ind, 1, "long bytes = ftell(f);\n");
+  ind_fprintf(d.stream, ind, 1, "fseek(f, 0, SEEK_SET);\n");
+  ind_fprintf(d.stream, ind, 1, "size_t n = bytes > 0 ? (size_t)bytes / "
+      "sizeof(uint64_t) : 0;\n");
+  ind_fprintf(d.stream, ind, 1, "uint64_t *raw = n > 0 ? "
+      "malloc(n * sizeof(uint64_t)) : NULL;\n");
+  ind_fprintf(d.stream, ind, 1, "if (raw == NULL || "
+      "fread(raw, sizeof(uint64_t), n, f) != n)\n");
+  ind_fprintf(d.stream, ind, 2, "return 1;\n");
+  ind_fprintf(d.stream, ind, 1, "fclose(f);\n");
+  ind_fprintf(d.stream, ind, 1, "%s *workload = malloc(n * sizeof(%s));\n",
+      get_opcode_type_str(d.opcode_bits), get_opcode_type_str(d.opcode_bits));
+  ind_fprintf(d.stream, ind, 1, "if (workload == NULL)\n");
+  ind_fprintf(d.stream, ind, 2, "return 1;\n");
+  ind_fprintf(d.stream, ind, 1, "for (size_t i = 0; i < n; i++) {\n");
+  ind_fprintf(d.stream, ind, 2, "workload[i] = raw[i];\n");
+  ind_fprintf(d.stream, ind, 1, "}\n");
+  fprintf(d.stream, "\n");
+  ind_fprintf(d.stream, ind, 0, "#ifdef __linux__\n");
+  ind_fprintf(d.stream, ind, 1, "cpu_set_t cpus;\n");
+  ind_fprintf(d.stream, ind, 1, "CPU_ZERO(&cpus);\n");
+  ind_fprintf(d.stream, ind, 1, "CPU_SET(sched_getcpu(), &cpus);\n");
+  ind_fprintf(d.stream, ind, 1, "sched_setaffinity(0, sizeof(cpus), &cpus);\n");
+  ind_fprintf(d.stream, ind, 0, "#endif\n");
+  fprintf(d.stream, "\n");
+  ind_fprintf(d.stream, ind, 1, "uint32_t checksum = 0;\n");
+  ind_fprintf(d.stream, ind, 1, "for (size_t i = 0; i < n; i++) {\n");
+  ind_fprintf(d.stream, ind, 2, "checksum = checksum * 31 + %s(workload[i]);\n",
+      d.decode_function_name);
+  ind_fprintf(d.stream, ind, 1, "}\n");
+  fprintf(d.stream, "\n");
+  ind_fprintf(d.stream, ind, 1, "size_t passes = n < 4000000 ? 4000000 / n : 1;"
+      "\n");
+  ind_fprintf(d.stream, ind, 1, "volatile uint32_t sink = 0;\n");
+  ind_fprintf(d.stream, ind, 1, "double best = 0;\n");
+  ind_fprintf(d.stream, ind, 1, "for (int run = 0; run < 6; run++) {\n");
+  ind_fprintf(d.stream, ind, 2, "uint32_t sum = 0;\n");
+  ind_fprintf(d.stream, ind, 2, "struct timespec start, end;\n");
+  ind_fprintf(d.stream, ind, 2, "clock_gettime(CLOCK_MONOTONIC, &start);\n");
+  ind_fprintf(d.stream, ind, 2, "for (size_t pass = 0; pass < passes; "
+      "pass++) {\n");
+  ind_fprintf(d.stream, ind, 3, "for (size_t i = 0; i < n; i++) {\n");
+  ind_fprintf(d.stream, ind, 4, "sum += %s(workload[i]);\n",
+      d.decode_function_name);
+  ind_fprintf(d.stream, ind, 3, "}\n");
+  ind_fprintf(d.stream, ind, 2, "}\n");
+  ind_fprintf(d.stream, ind, 2, "clock_gettime(CLOCK_MONOTONIC, &end);\n");
+  ind_fprintf(d.stream, ind, 2, "sink += sum;\n");
+  fprintf(d.stream, "\n");
+  ind_fprintf(d.stream, ind, 2, "double ns = ((end.tv_sec - start.tv_sec) * "
+      "1e9 +\n");
+  ind_fprintf(d.stream, ind, 4, "(end.tv_nsec - start.tv_nsec)) / "
+      "((double)n * passes);\n");
+  ind_fprintf(d.stream, ind, 2, "// The first run only warms up.\n");
+  ind_fprintf(d.stream, ind, 2, "if (run == 1 || (run > 1 && ns < best))\n");
+  ind_fprintf(d.stream, ind, 3, "best = ns;\n");
+  ind_fprintf(d.stream, ind, 1, "}\n");
+  ind_fprintf(d.stream, ind, 1, "printf(\"%%f %%u\\n\", best, checksum);\n");
+  ind_fprintf(d.stream, ind, 1, "return 0;\n");
+  fprintf(d.stream, "}\n");
+}
+
+// Builds a benchmark for the variant in dir with the system compiler, $CC or
+// cc, runs it on the workload in dir/workload.bin and returns the nanoseconds
+// per decode, or a negative number if it couldn't be built or run. checksum is
+// set to the one the benchmark printed.
+double benchmark_decoder_variant(OpcodenatorData d, DecoderVariant variant,
+    const char *dir, uint32_t *checksum) {
+  ShortString name = get_variant_name(d, variant);
+  ShortString source = shortf("%s/%s.c", dir, name.val);
+  ShortString binary = shortf("%s/%s", dir, name.val);
+  const char *cc = getenv("CC") != NULL ? getenv("CC") : "cc";
+  double ns = -1;
+
+  d.profile = false;
+  d.stream = fopen(source.val, "w");
+  if (d.stream == NULL)
+    return -1;
+
+  fprintf(d.stream, "#define _GNU_SOURCE\n");
+  fprintf(d.stream, "#include <sched.h>\n");
+  fprintf(d.stream, "#include <stdio.h>\n");
+  fprintf(d.stream, "#include <stdlib.h>\n");
+  fprintf(d.stream, "#include <time.h>\n");
+  print_includes(d);
+  fprintf(d.stream, "\n");
+  print_enum_declaration(d);
+  fprintf(d.stream, "\n");
+  print_decoder_variant(d, variant);
+  fprintf(d.stream, "\n");
+  print_benchmark_main(d);
+  fclose(d.stream);
+
+  ShortString build = shortf("%s -O2 -o %s %s", cc, binary.val, source.val);
+  ShortString run = shortf("%s %s/workload.bin", binary.val, dir);
+  if (system(build.val) == 0) {
+    FILE *output = popen(run.val, "r");
+    if (output != NULL) {
+      if (fscanf(output, "%lf %u", &ns, checksum) != 2)
+        ns = -1;
+      if (pclose(output) != 0)
+        ns = -1;
+    }
+  }
+
+  remove(source.val);
+  remove(binary.val);
+  return ns;
+}
+
+// Benchmarks every variant on this host and returns the index of the fastest.
+// workload is a sample of opcodes as they are found in practice, if it's NULL
+// every opcode is benchmarked equally often. Only opcodes up to 64 bits.
+// A variant is only picked if it decodes the workload to the same types as
+// get_reference_type(). The switch decoder doesn't check the operand bits of
+// the opcode it lands on, so it's rejected for a workload with invalid inputs
+// it doesn't catch.
+uint32_t autotune_decoder(OpcodenatorData d, DecoderBenchmark *variants,
+    uint32_t n, const uint64_t *workload, size_t workload_size) {
+  assert(n > 0);
+  if (d.opcode_bits > 64) {
+    fprintf(stderr, "can't autotune opcodes wider than 64 bits\n");
+    exit(1);
+  }
+
+  char dir[] = "/tmp/opcodenator-XXXXXX";
+  if (mkdtemp(dir) == NULL) {
+    fprintf(stderr, "can't create a directory for the benchmarks\n");
+    exit(1);
+  }
+
+  uint64_t *sample = NULL;
+  if (workload == NULL) {
+    sample = get_sample_workload(d, &workload_size);
+    workload = sample;
+  }
+
+  ShortString workload_path = shortf("%s/workload.bin", dir);
+  FILE *f = fopen(workload_path.val, "wb");
+  assert(f != NULL);
+  for (size_t i = 0; i < workload_size; i++) {
+    write_le(f, workload[i], 8);
+  }
+  fclose(f);
+  uint32_t reference = get_workload_checksum(d, workload, workload_size);
+  free(sample);
+
+  uint32_t best = n;
+  for (uint32_t i = 0; i < n; i++) {
+    uint32_t checksum = 0;
+    variants[i].ns_per_decode = benchmark_decoder_variant(d,
+        variants[i].variant, dir, &checksum);
+    variants[i].mismatch = false;
+    if (variants[i].ns_per_decode < 0) {
+      fprintf(stderr, "benchmark of %s failed\n",
+          get_variant_name(d, variants[i].variant).val);
+      continue;
+    }
+    if (checksum != reference) {
+      variants[i].mismatch = true;
+      fprintf(stderr, "%s decoded the workload wrong, checksum %08X "
+          "instead of %08X\n", get_variant_name(d, variants[i].variant).val,
+          checksum, reference);
+      continue;
+    }
+
+    if (best == n || variants[i].ns_per_decode < variants[best].ns_per_decode)
+      best = i;
+  }
+
+  remove(workload_path.val);
+  rmdir(dir);
+  if (best == n) {
+    fprintf(stderr, "every benchmark failed or decoded wrong\n");
+    exit(1);
+  }
+
+  return best;
+}
+
+// Comment with the results of autotune_decoder(), best is the one it returned.
+void print_autotune_report(OpcodenatorData d, const DecoderBenchmark *variants,
+    uint32_t n, uint32_t best) {
+  ind_fprintf(d.stream, d.indent_string, 0, "// Decoder picked by benchmarking "
+      "every variant on the host that\n");
+  ind_fprintf(d.stream, d.indent_string, 0, "// generated this file:\n");
+  for (uint32_t i = 0; i < n; i++) {
+    ShortString name = get_variant_name(d, variants[i].variant);
+    if (variants[i].ns_per_decode < 0) {
+      ind_fprintf(d.stream, d.indent_string, 0, "//   %-14s failed\n",
+          name.val);
+      continue;
+    }
+    if (variants[i].mismatch) {
+      ind_fprintf(d.stream, d.indent_string, 0,
+          "//   %-14s %7.3f ns/decode, decoded wrong\n", name.val,
+          variants[i].ns_per_decode);
+      continue;
+    }
+
+    ind_fprintf(d.stream, d.indent_string, 0, "//   %-14s %7.3f ns/decode%s\n",
+        name.val, variants[i].ns_per_decode, i == best ? " <- used" : "");
+  }
+}
+
+// ORs byte p[byte] into the opcode being assembled, starting at bit.
+void print_opcode_byte_load(OpcodenatorData d, int ind_lvl, uint32_t byte,
+    uint32_t bit) {
+  if (d.opcode_bits > 64) {
+    ind_fprintf(d.stream, d.indent_string, ind_lvl,
+        "opcode[%u] |= (uint64_t)p[%u] << %u;\n", bit / 64, byte, bit % 64);
+    return;
+  }
+
+  ind_fprintf(d.stream, d.indent_string, ind_lvl,
+      "opcode |= (%s)p[%u] << %u;\n",
+      get_opcode_type_str(d.opcode_bits), byte, bit);
+}
+
+// Wrapper around the decode function that reads the opcode straight from
+// memory. The opcode is made of word_bits sized little endian words, the first
+// word in memory being the most significant one (AVR's 32 bit instructions are
+// two 16 bit words stored this way). Reads opcode_bits / 8 bytes, even if the
+// opcode that ends up being decoded is shorter.
+void print_pointer_decoder_function(OpcodenatorData d, uint8_t word_bits) {
+  assert(word_bits % 8 == 0 && "word_bits must be a multiple of 8");
+  assert(d.opcode_bits % word_bits == 0 &&
+      "opcode_bits must be a multiple of word_bits");
+  const char *opcode_type = get_opcode_type_str(d.opcode_bits);
+  uint8_t words = d.opcode_bits / word_bits;
+  uint8_t word_bytes = word_bits / 8;
+
+  fprintf(d.stream, "OpcodeType %s_le(const uint8_t *p) {\n",
+      d.decode_function_name);
+  ind_fprintf(d.stream, d.indent_string, 1, "%s opcode = %s;\n", opcode_type,
+      d.opcode_bits > 64 ? "{ 0 }" : "0");
+  for (uint8_t i = 0; i < words; i++) {
+    for (uint8_t j = 0; j < word_bytes; j++) {
+      print_opcode_byte_load(d, 1, i * word_bytes + j,
+          (words - i - 1) * word_bits + j * 8);
+    }
+  }
+  ind_fprintf(d.stream, d.indent_string, 1, "return %s(opcode);\n",
+      d.decode_function_name);
+  fprintf(d.stream, "}\n");
+}
+
+uint8_t get_opcode_words(OpcodeData opcode) {
+  return opcode.length == 0 ? 1 : opcode.length;
+}
+
+// DecodedOpcode and what print_pointer_decoder_function() and
+// print_fetch_function() define, for a header. Needs the output of
+// print_metadata_declaration().
+void print_fetch_declarations(OpcodenatorData d) {
+  ind_fprintf(d.stream, d.indent_string, 0, "typedef struct {\n");
+  ind_fprintf(d.stream, d.indent_string, 1, "OpcodeType type;\n");
+  ind_fprintf(d.stream, d.indent_string, 1, "%s opcode;\n",
+      get_opcode_type_str(d.opcode_bits));
+  ind_fprintf(d.stream, d.indent_string, 0, "} DecodedOpcode;\n");
+  fprintf(d.stream, "\n");
+  fprintf(d.stream, "OpcodeType %s_le(const uint8_t *p);\n",
+      d.decode_function_name);
+  fprintf(d.stream,
+      "uint32_t %s_fetch_le(const uint8_t *p, uint32_t available,\n",
+      d.decode_function_name);
+  ind_fprintf(d.stream, d.indent_string, 2, "DecodedOpcode *out);\n");
+}
+
+// Emits <decode>_fetch_le(), which decodes one opcode from memory laid out
+// like print_pointer_decoder_function() expects.
+// Unlike <decode>_le() it only reads the words the opcode actually takes: it
+// decodes the first word with the rest zeroed and only reads more words if the
+// opcode it got is longer. When a longer opcode has fixed bits past the words
+// read so far, an INVALID_OP also reads on, since it may be that opcode.
+// Returns the number of words the opcode takes, or 0 when that's more than the
+// available words. The lengths come from opcode_metadata[]. Needs the output of
+// print_fetch_declarations() and print_metadata_definition().
+void print_fetch_function(OpcodenatorData d, uint8_t word_bits) {
+  assert(word_bits % 8 == 0 && "word_bits must be a multiple of 8");
+  assert(d.opcode_bits % word_bits == 0 &&
+      "opcode_bits must be a multiple of word_bits");
+  const char *opcode_type = get_opcode_type_str(d.opcode_bits);
+  uint8_t words = d.opcode_bits / word_bits;
+  uint8_t word_bytes = word_bits / 8;
+
+  for (int i = 0; i < d.size; i++) {
+    if (get_opcode_words(d.opcodes[i]) > words) {
+      fprintf(stderr, "%s is %u words long, opcodes are only %u words\n",
+          d.opcodes[i].enum_str, get_opcode_words(d.opcodes[i]), words);
+      exit(1);
+    }
+  }
+
+  fprintf(d.stream,
+      "uint32_t %s_fetch_le(const uint8_t *p, uint32_t available,\n",
+      d.decode_function_name);
+  ind_fprintf(d.stream, d.indent_string, 2, "DecodedOpcode *out) {\n");
+  ind_fprintf(d.stream, d.indent_string, 1, "%s opcode = %s;\n", opcode_type,
+      d.opcode_bits > 64 ? "{ 0 }" : "0");
+  if (words > 1)
+    ind_fprintf(d.stream, d.indent_string, 1, "uint32_t length;\n");
+  for (uint8_t i = 0; i < words; i++) {
+    ind_fprintf(d.stream, d.indent_string, 1, "if (available < %u)\n", i + 1);
+    ind_fprintf(d.stream, d.indent_string, 2, "return 0;\n");
+    for (uint8_t j = 0; j < word_bytes; j++) {
+      print_opcode_byte_load(d, 1, i * word_bytes + j,
+          (words - i - 1) * word_bits + j * 8);
+    }
+    ind_fprintf(d.stream, d.indent_string, 1, "out->type = %s(opcode);\n",
+        d.decode_function_name);
+    ind_fprintf(d.stream, d.indent_string, 1, "out->opcode = opcode;\n");
+    if (i + 1 < words) {
+      bool read_on = false;
+      for (int j = 0; j < d.size && !read_on; j++) {
+        read_on = get_opcode_words(d.opcodes[j]) > i + 1 &&
+          has_fixed_bits_below(d.opcodes[j], d.opcode_bits,
+              (words - i - 1) * word_bits);
+      }
+      ind_fprintf(d.stream, d.indent_string, 1,
+          "length = OPCODE_META_LENGTH(opcode_metadata[out->type]);\n");
+      ind_fprintf(d.stream, d.indent_string, 1, "if (%slength <= %u)\n",
+          read_on ? "out->type != INVALID_OP && " : "", i + 1);
+      ind_fprintf(d.stream, d.indent_string, 2, "return length;\n");
+    }
+  }
+  ind_fprintf(d.stream, d.indent_string, 1,
+      "return OPCODE_META_LENGTH(opcode_metadata[out->type]);\n");
+  fprintf(d.stream, "}\n");
+}
+
+// Configuration macros, types and prototypes of the block cache
+// print_block_cache() emits. Needs the output of print_fetch_declarations().
+void print_block_cache_declarations(OpcodenatorData d) {
+  const char *ind = d.indent_string;
+
+  ind_fprintf(d.stream, ind, 0, "#ifndef OPCODE_BLOCK_MAX_OPS\n");
+  ind_fprintf(d.stream, ind, 0, "#define OPCODE_BLOCK_MAX_OPS 32\n");
+  ind_fprintf(d.stream, ind, 0, "#endif\n");
+  ind_fprintf(d.stream, ind, 0, "#ifndef OPCODE_BLOCK_CACHE_SIZE\n");
+  ind_fprintf(d.stream, ind, 0, "#define OPCODE_BLOCK_CACHE_SIZE 1024\n");
+  ind_fprintf(d.stream, ind, 0, "#endif\n");
+  ind_fprintf(d.stream, ind, 0,
+      "_Static_assert((OPCODE_BLOCK_CACHE_SIZE & "
+      "(OPCODE_BLOCK_CACHE_SIZE - 1)) == 0,\n");
+  ind_fprintf(d.stream, ind, 2,
+      "\"OPCODE_BLOCK_CACHE_SIZE must be a power of two\");\n");
+  fprintf(d.stream, "\n");
+
+  ind_fprintf(d.stream, ind, 0, "typedef struct OpcodeBlock {\n");
+  ind_fprintf(d.stream, ind, 1, "uint32_t start;\n");
+  ind_fprintf(d.stream, ind, 1, "uint32_t end;\n");
+  ind_fprintf(d.stream, ind, 1, "uint16_t size;\n");
+  ind_fprintf(d.stream, ind, 1, "uint8_t valid;\n");
+  ind_fprintf(d.stream, ind, 1, "// [0] falls through to end, [1] is taken.\n");
+  ind_fprintf(d.stream, ind, 1, "struct OpcodeBlock *next[2];\n");
+  ind_fprintf(d.stream, ind, 1, "DecodedOpcode ops[OPCODE_BLOCK_MAX_OPS];\n");
+  ind_fprintf(d.stream, ind, 0, "} OpcodeBlock;\n");
+  fprintf(d.stream, "\n");
+
+  ind_fprintf(d.stream, ind, 0, "typedef struct {\n");
+  ind_fprintf(d.stream, ind, 1, "const uint8_t *flash;\n");
+  ind_fprintf(d.stream, ind, 1, "uint32_t flash_words;\n");
+  ind_fprintf(d.stream, ind, 1,
+      "OpcodeBlock blocks[OPCODE_BLOCK_CACHE_SIZE];\n");
+  ind_fprintf(d.stream, ind, 0, "} OpcodeBlockCache;\n");
+  fprintf(d.stream, "\n");
+
+  fprintf(d.stream, "void opcode_block_cache_init(OpcodeBlockCache *cache, "
+      "const uint8_t *flash,\n");
+  ind_fprintf(d.stream, ind, 2, "uint32_t flash_words);\n");
+  fprintf(d.stream, "OpcodeBlock *opcode_block_lookup(OpcodeBlockCache *cache, "
+      "uint32_t pc);\n");
+  fprintf(d.stream, "OpcodeBlock *opcode_block_next(OpcodeBlockCache *cache, "
+      "OpcodeBlock *from,\n");
+  ind_fprintf(d.stream, ind, 2, "uint32_t pc);\n");
+  fprintf(d.stream, "void opcode_block_invalidate(OpcodeBlockCache *cache, "
+      "uint32_t addr,\n");
+  ind_fprintf(d.stream, ind, 2, "uint32_t words);\n");
+}
+
+// Emits a cache of predecoded basic blocks keyed by their start pc (in words).
+// A block runs until an opcode with a flow attribute (per opcode_metadata[]) or
+// INVALID_OP, so every block has a single exit. Blocks are chained to their
+// successors by opcode_block_next() and dropped by opcode_block_invalidate()
+// when flash is written. Lookups return NULL when not even one opcode fits in
+// flash at pc. The cache is direct mapped, so a block pointer is only good
+// until the next lookup. Needs the output of print_block_cache_declarations()
+// and print_fetch_function().
+void print_block_cache(OpcodenatorData d, uint8_t word_bits) {
+  const char *ind = d.indent_string;
+  uint8_t words = d.opcode_bits / word_bits;
+
+  fprintf(d.stream, "void opcode_block_cache_init(OpcodeBlockCache *cache, "
+      "const uint8_t *flash,\n");
+  ind_fprintf(d.stream, ind, 2, "uint32_t flash_words) {\n");
+  ind_fprintf(d.stream, ind, 1, "cache->flash = flash;\n");
+  ind_fprintf(d.stream, ind, 1, "cache->flash_words = flash_words;\n");
+  ind_fprintf(d.stream, ind, 1,
+      "for (uint32_t i = 0; i < OPCODE_BLOCK_CACHE_SIZE; i++) {\n");
+  ind_fprintf(d.stream, ind, 2, "cache->blocks[i].valid = 0;\n");
+  ind_fprintf(d.stream, ind, 1, "}\n");
+  fprintf(d.stream, "}\n");
+  fprintf(d.stream, "\n");
+
+  ind_fprintf(d.stream, ind, 0, "// The block starting at pc, decoded into "
+      "the slot of pc if it's not cached.\n");
+  ind_fprintf(d.stream, ind, 0, "// That evicts the block in the slot, "
+      "pointers to it are invalid after this.\n");
+  fprintf(d.stream, "OpcodeBlock *opcode_block_lookup(OpcodeBlockCache *cache, "
+      "uint32_t pc) {\n");
+  ind_fprintf(d.stream, ind, 1, "OpcodeBlock *block = "
+      "&cache->blocks[pc & (OPCODE_BLOCK_CACHE_SIZE - 1)];\n");
+  ind_fprintf(d.stream, ind, 1, "if (block->valid && block->start == pc)\n");
+  ind_fprintf(d.stream, ind, 2, "return block;\n");
+  fprintf(d.stream, "\n");
+  ind_fprintf(d.stream, ind, 1, "block->start = pc;\n");
+  ind_fprintf(d.stream, ind, 1, "block->size = 0;\n");
+  ind_fprintf(d.stream, ind, 1, "block->next[0] = NULL;\n");
+  ind_fprintf(d.stream, ind, 1, "block->next[1] = NULL;\n");
+  ind_fprintf(d.stream, ind, 1,
+      "while (block->size < OPCODE_BLOCK_MAX_OPS &&\n");
+  ind_fprintf(d.stream, ind, 3, "pc < cache->flash_words) {\n");
+  ind_fprintf(d.stream, ind, 2,
+      "DecodedOpcode *op = &block->ops[block->size];\n");
+  ind_fprintf(d.stream, ind, 2,
+      "uint32_t words = %s_fetch_le(cache->flash + pc * %u,\n",
+      d.decode_function_name, word_bits / 8);
+  ind_fprintf(d.stream, ind, 4, "cache->flash_words - pc, op);\n");
+  ind_fprintf(d.stream, ind, 2, "if (words == 0)\n");
+  ind_fprintf(d.stream, ind, 3, "break;\n");
+  fprintf(d.stream, "\n");
+  ind_fprintf(d.stream, ind, 2, "block->size++;\n");
+  ind_fprintf(d.stream, ind, 2, "pc += words;\n");
+  ind_fprintf(d.stream, ind, 2, "if (op->type == INVALID_OP ||\n");
+  ind_fprintf(d.stream, ind, 4,
+      "OPCODE_META_FLOW(opcode_metadata[op->type]) != FLOW_NONE)\n");
+  ind_fprintf(d.stream, ind, 3, "break;\n");
+  ind_fprintf(d.stream, ind, 1, "}\n");
+  ind_fprintf(d.stream, ind, 1, "block->end = pc;\n");
+  ind_fprintf(d.stream, ind, 1, "block->valid = block->size > 0;\n");
+  ind_fprintf(d.stream, ind, 1, "return block->valid ? block : NULL;\n");
+  fprintf(d.stream, "}\n");
+  fprintf(d.stream, "\n");
+
+  ind_fprintf(d.stream, ind, 0, "// Block that runs after from when execution "
+      "continues at pc, following the\n");
+  ind_fprintf(d.stream, ind, 0, "// chain if it's still valid and "
+      "(re)chaining it otherwise. from is invalid\n");
+  ind_fprintf(d.stream, ind, 0, "// after this, unless it's what's "
+      "returned.\n");
+  fprintf(d.stream, "OpcodeBlock *opcode_block_next(OpcodeBlockCache *cache, "
+      "OpcodeBlock *from,\n");
+  ind_fprintf(d.stream, ind, 2, "uint32_t pc) {\n");
+  ind_fprintf(d.stream, ind, 1, "int taken = pc != from->end;\n");
+  ind_fprintf(d.stream, ind, 1, "OpcodeBlock *next = from->next[taken];\n");
+  ind_fprintf(d.stream, ind, 1,
+      "if (next != NULL && next->valid && next->start == pc)\n");
+  ind_fprintf(d.stream, ind, 2, "return next;\n");
+  fprintf(d.stream, "\n");
+  ind_fprintf(d.stream, ind, 1, "next = opcode_block_lookup(cache, pc);\n");
+  ind_fprintf(d.stream, ind, 1, "// When pc maps to the slot of from, "
+      "from was just evicted.\n");
+  ind_fprintf(d.stream, ind, 1,
+      "if (next != NULL && next != from && from->valid)\n");
+  ind_fprintf(d.stream, ind, 2, "from->next[taken] = next;\n");
+  ind_fprintf(d.stream, ind, 1, "return next;\n");
+  fprintf(d.stream, "}\n");
+  fprintf(d.stream, "\n");
+
+  ind_fprintf(d.stream, ind, 0, "// Call after writing words [addr, addr + "
+      "words) of flash. A block spans at most\n");
+  ind_fprintf(d.stream, ind, 0, "// OPCODE_BLOCK_MAX_OPS opcodes of %u "
+      "words, so only the slots of the pcs that\n", words);
+  ind_fprintf(d.stream, ind, 0, "// close to addr can hold a block that "
+      "overlaps the write.\n");
+  fprintf(d.stream, "void opcode_block_invalidate(OpcodeBlockCache *cache, "
+      "uint32_t addr,\n");
+  ind_fprintf(d.stream, ind, 2, "uint32_t words) {\n");
+  ind_fprintf(d.stream, ind, 1,
+      "const uint32_t span = OPCODE_BLOCK_MAX_OPS * %u;\n", words);
+  ind_fprintf(d.stream, ind, 1,
+      "uint32_t first = addr > span ? addr - span : 0;\n");
+  ind_fprintf(d.stream, ind, 1, "for (uint32_t start = first; "
+      "start < addr + words &&\n");
+  ind_fprintf(d.stream, ind, 3,
+      "start - first < OPCODE_BLOCK_CACHE_SIZE; start++) {\n");
+  ind_fprintf(d.stream, ind, 2, "OpcodeBlock *block = "
+      "&cache->blocks[start & (OPCODE_BLOCK_CACHE_SIZE - 1)];\n");
+  ind_fprintf(d.stream, ind, 2,
+      "if (block->start < addr + words && addr < block->end)\n");
+  ind_fprintf(d.stream, ind, 3, "block->valid = 0;\n");
+  ind_fprintf(d.stream, ind, 1, "}\n");
+  fprintf(d.stream, "}\n");
+}
+
+// Types and prototypes of the thread safe predecoder print_predecode_cache()
+// emits. Needs the output of print_fetch_declarations().
+void print_predecode_declarations(OpcodenatorData d) {
+  const char *ind = d.indent_string;
+
+  ind_fprintf(d.stream, ind, 0, "#include <stdatomic.h>\n");
+  fprintf(d.stream, "\n");
+  ind_fprintf(d.stream, ind, 0, "#ifndef OPCODE_FLASH_PAGE_WORDS\n");
+  ind_fprintf(d.stream, ind, 0, "#define OPCODE_FLASH_PAGE_WORDS 64\n");
+  ind_fprintf(d.stream, ind, 0, "#endif\n");
+  ind_fprintf(d.stream, ind, 0, "#ifndef OPCODE_PREDECODE_SIZE\n");
+  ind_fprintf(d.stream, ind, 0, "#define OPCODE_PREDECODE_SIZE 4096\n");
+  ind_fprintf(d.stream, ind, 0, "#endif\n");
+  ind_fprintf(d.stream, ind, 0,
+      "_Static_assert((OPCODE_PREDECODE_SIZE & "
+      "(OPCODE_PREDECODE_SIZE - 1)) == 0,\n");
+  ind_fprintf(d.stream, ind, 2,
+      "\"OPCODE_PREDECODE_SIZE must be a power of two\");\n");
+  ind_fprintf(d.stream, ind, 0, "// Size of the generations array for "
+      "flash_words words of flash.\n");
+  ind_fprintf(d.stream, ind, 0, "#define OPCODE_FLASH_PAGES(flash_words) \\\n");
+  ind_fprintf(d.stream, ind, 1,
+      "(((flash_words) + OPCODE_FLASH_PAGE_WORDS - 1) / "
+      "OPCODE_FLASH_PAGE_WORDS)\n");
+  fprintf(d.stream, "\n");
+
+  ind_fprintf(d.stream, ind, 0, "// Shared by every thread that decodes "
+      "from flash. A page's generation is\n");
+  ind_fprintf(d.stream, ind, 0, "// odd while it's being written and "
+      "goes up on every write.\n");
+  ind_fprintf(d.stream, ind, 0, "typedef struct {\n");
+  ind_fprintf(d.stream, ind, 1, "const uint8_t *flash;\n");
+  ind_fprintf(d.stream, ind, 1, "uint32_t flash_words;\n");
+  ind_fprintf(d.stream, ind, 1, "_Atomic uint32_t *generations;\n");
+  ind_fprintf(d.stream, ind, 0, "} OpcodeFlash;\n");
+  fprintf(d.stream, "\n");
+  ind_fprintf(d.stream, ind, 0, "typedef struct {\n");
+  ind_fprintf(d.stream, ind, 1, "uint32_t pc;\n");
+  ind_fprintf(d.stream, ind, 1, "uint32_t generation;\n");
+  ind_fprintf(d.stream, ind, 1, "// 0 when the entry is empty.\n");
+  ind_fprintf(d.stream, ind, 1, "uint32_t words;\n");
+  ind_fprintf(d.stream, ind, 1, "DecodedOpcode op;\n");
+  ind_fprintf(d.stream, ind, 0, "} OpcodePredecoded;\n");
+  fprintf(d.stream, "\n");
+  ind_fprintf(d.stream, ind, 0, "// Owned by a single thread, "
+      "never shared.\n");
+  ind_fprintf(d.stream, ind, 0, "typedef struct {\n");
+  ind_fprintf(d.stream, ind, 1, "const OpcodeFlash *flash;\n");
+  ind_fprintf(d.stream, ind, 1,
+      "OpcodePredecoded entries[OPCODE_PREDECODE_SIZE];\n");
+  ind_fprintf(d.stream, ind, 0, "} OpcodePredecodeCache;\n");
+  fprintf(d.stream, "\n");
+
+  fprintf(d.stream, "void opcode_flash_init(OpcodeFlash *flash, "
+      "const uint8_t *bytes,\n");
+  ind_fprintf(d.stream, ind, 2, "uint32_t flash_words, "
+      "_Atomic uint32_t *generations);\n");
+  fprintf(d.stream, "void opcode_flash_write_begin(OpcodeFlash *flash, "
+      "uint32_t addr,\n");
+  ind_fprintf(d.stream, ind, 2, "uint32_t words);\n");
+  fprintf(d.stream, "void opcode_flash_write_end(OpcodeFlash *flash, "
+      "uint32_t addr,\n");
+  ind_fprintf(d.stream, ind, 2, "uint32_t words);\n");
+  fprintf(d.stream,
+      "void opcode_predecode_init(OpcodePredecodeCache *cache,\n");
+  ind_fprintf(d.stream, ind, 2, "const OpcodeFlash *flash);\n");
+  fprintf(d.stream, "uint32_t opcode_predecode(OpcodePredecodeCache *cache, "
+      "uint32_t pc,\n");
+  ind_fprintf(d.stream, ind, 2, "DecodedOpcode *out);\n");
+}
+
+void print_flash_pages_loop(OpcodenatorData d, const char *memory_order) {
+  const char *ind = d.indent_string;
+
+  // Nothing to bump for an empty range, and a range running past the end of
+  // flash stops at its last page instead of touching generations[] beyond it.
+  ind_fprintf(d.stream, ind, 1, "if (words == 0 || addr >= "
+      "flash->flash_words)\n");
+  ind_fprintf(d.stream, ind, 2, "return;\n");
+  ind_fprintf(d.stream, ind, 1, "uint32_t end = words <= "
+      "flash->flash_words - addr ? addr + words :\n");
+  ind_fprintf(d.stream, ind, 2, "flash->flash_words;\n");
+  ind_fprintf(d.stream, ind, 1, "for (uint32_t page = addr / "
+      "OPCODE_FLASH_PAGE_WORDS;\n");
+  ind_fprintf(d.stream, ind, 3, "page <= (end - 1) / "
+      "OPCODE_FLASH_PAGE_WORDS; page++) {\n");
+  ind_fprintf(d.stream, ind, 2, "atomic_fetch_add_explicit("
+      "&flash->generations[page], 1,\n");
+  ind_fprintf(d.stream, ind, 4, "%s);\n", memory_order);
+  ind_fprintf(d.stream, ind, 1, "}\n");
+}
+
+// Emits a predecoder for many threads decoding the same flash. The
+// OpcodeFlash is shared and only read on the hot path, every thread keeps its
+// own OpcodePredecodeCache so a hit doesn't write to shared memory and
+// nothing takes a lock. Entries remember the generations of the pages the
+// opcode could span, writers bracket flash writes with
+// opcode_flash_write_begin() and opcode_flash_write_end() like a seqlock and
+// readers retry when a generation changed under them. Writes to the same page
+// from more than one thread have to be serialized by the caller. Needs the
+// output of print_predecode_declarations() and print_fetch_function().
+void print_predecode_cache(OpcodenatorData d, uint8_t word_bits) {
+  const char *ind = d.indent_string;
+  uint8_t words = d.opcode_bits / word_bits;
+
+  fprintf(d.stream, "void opcode_flash_init(OpcodeFlash *flash, "
+      "const uint8_t *bytes,\n");
+  ind_fprintf(d.stream, ind, 2, "uint32_t flash_words, "
+      "_Atomic uint32_t *generations) {\n");
+  ind_fprintf(d.stream, ind, 1, "flash->flash = bytes;\n");
+  ind_fprintf(d.stream, ind, 1, "flash->flash_words = flash_words;\n");
+  ind_fprintf(d.stream, ind, 1, "flash->generations = generations;\n");
+  ind_fprintf(d.stream, ind, 1, "for (uint32_t i = 0; "
+      "i < OPCODE_FLASH_PAGES(flash_words); i++) {\n");
+  ind_fprintf(d.stream, ind, 2, "atomic_init(&generations[i], 0);\n");
+  ind_fprintf(d.stream, ind, 1, "}\n");
+  fprintf(d.stream, "}\n");
+  fprintf(d.stream, "\n");
+
+  ind_fprintf(d.stream, ind, 0, "// Call before writing words [addr, addr + "
+      "words) of flash.\n");
+  fprintf(d.stream, "void opcode_flash_write_begin(OpcodeFlash *flash, "
+      "uint32_t addr,\n");
+  ind_fprintf(d.stream, ind, 2, "uint32_t words) {\n");
+  print_flash_pages_loop(d, "memory_order_relaxed");
+  ind_fprintf(d.stream, ind, 1,
+      "atomic_thread_fence(memory_order_release);\n");
+  fprintf(d.stream, "}\n");
+  fprintf(d.stream, "\n");
+
+  ind_fprintf(d.stream, ind, 0, "// Call after writing, with the same range "
+      "as opcode_flash_write_begin().\n");
+  fprintf(d.stream, "void opcode_flash_write_end(OpcodeFlash *flash, "
+      "uint32_t addr,\n");
+  ind_fprintf(d.stream, ind, 2, "uint32_t words) {\n");
+  print_flash_pages_loop(d, "memory_order_release");
+  fprintf(d.stream, "}\n");
+  fprintf(d.stream, "\n");
+
+  fprintf(d.stream,
+      "void opcode_predecode_init(OpcodePredecodeCache *cache,\n");
+  ind_fprintf(d.stream, ind, 2, "const OpcodeFlash *flash) {\n");
+  ind_fprintf(d.stream, ind, 1, "cache->flash = flash;\n");
+  ind_fprintf(d.stream, ind, 1,
+      "for (uint32_t i = 0; i < OPCODE_PREDECODE_SIZE; i++) {\n");
+  ind_fprintf(d.stream, ind, 2, "cache->entries[i].words = 0;\n");
+  ind_fprintf(d.stream, ind, 1, "}\n");
+  fprintf(d.stream, "}\n");
+  fprintf(d.stream, "\n");
+
+  ind_fprintf(d.stream, ind, 0, "// Decodes the opcode at pc (in words), "
+      "returns how many words it takes or 0\n");
+  ind_fprintf(d.stream, ind, 0, "// if it doesn't fit in flash.\n");
+  fprintf(d.stream, "uint32_t opcode_predecode(OpcodePredecodeCache *cache, "
+      "uint32_t pc,\n");
+  ind_fprintf(d.stream, ind, 2, "DecodedOpcode *out) {\n");
+  ind_fprintf(d.stream, ind, 1, "const OpcodeFlash *flash = cache->flash;\n");
+  ind_fprintf(d.stream, ind, 1, "if (pc >= flash->flash_words)\n");
+  ind_fprintf(d.stream, ind, 2, "return 0;\n");
+  fprintf(d.stream, "\n");
+  ind_fprintf(d.stream, ind, 1, "uint32_t last = pc + %u < flash->flash_words ?"
+      " pc + %u :\n", words - 1, words - 1);
+  ind_fprintf(d.stream, ind, 2, "flash->flash_words - 1;\n");
+  ind_fprintf(d.stream, ind, 1, "_Atomic uint32_t *first_page = "
+      "&flash->generations[pc / OPCODE_FLASH_PAGE_WORDS];\n");
+  ind_fprintf(d.stream, ind, 1, "_Atomic uint32_t *last_page = "
+      "&flash->generations[last / OPCODE_FLASH_PAGE_WORDS];\n");
+  ind_fprintf(d.stream, ind, 1, "OpcodePredecoded *entry = "
+      "&cache->entries[pc & (OPCODE_PREDECODE_SIZE - 1)];\n");
+  ind_fprintf(d.stream, ind, 1, "for (;;) {\n");
+  ind_fprintf(d.stream, ind, 2, "uint32_t first_generation = "
+      "atomic_load_explicit(first_page,\n");
+  ind_fprintf(d.stream, ind, 4, "memory_order_acquire);\n");
+  ind_fprintf(d.stream, ind, 2, "uint32_t last_generation = "
+      "atomic_load_explicit(last_page,\n");
+  ind_fprintf(d.stream, ind, 4, "memory_order_acquire);\n");
+  ind_fprintf(d.stream, ind, 2,
+      "if ((first_generation | last_generation) & 1)\n");
+  ind_fprintf(d.stream, ind, 3, "continue;\n");
+  fprintf(d.stream, "\n");
+  ind_fprintf(d.stream, ind, 2, "// Generations only go up, so the sum only "
+      "stays the same if neither changed.\n");
+  ind_fprintf(d.stream, ind, 2,
+      "uint32_t generation = first_generation + last_generation;\n");
+  ind_fprintf(d.stream, ind, 2,
+      "if (entry->words != 0 && entry->pc == pc &&\n");
+  ind_fprintf(d.stream, ind, 4, "entry->generation == generation) {\n");
+  ind_fprintf(d.stream, ind, 3, "*out = entry->op;\n");
+  ind_fprintf(d.stream, ind, 3, "return entry->words;\n");
+  ind_fprintf(d.stream, ind, 2, "}\n");
+  fprintf(d.stream, "\n");
+  ind_fprintf(d.stream, ind, 2, "DecodedOpcode op;\n");
+  ind_fprintf(d.stream, ind, 2,
+      "uint32_t words = %s_fetch_le(flash->flash + pc * %u,\n",
+      d.decode_function_name, word_bits / 8);
+  ind_fprintf(d.stream, ind, 4, "flash->flash_words - pc, &op);\n");
+  ind_fprintf(d.stream, ind, 2, "atomic_thread_fence(memory_order_acquire);\n");
+  ind_fprintf(d.stream, ind, 2, "if (atomic_load_explicit(first_page, "
+      "memory_order_relaxed) != first_generation ||\n");
+  ind_fprintf(d.stream, ind, 4, "atomic_load_explicit(last_page, "
+      "memory_order_relaxed) != last_generation)\n");
+  ind_fprintf(d.stream, ind, 3, "continue;\n");
+  fprintf(d.stream, "\n");
+  ind_fprintf(d.stream, ind, 2, "entry->pc = pc;\n");
+  ind_fprintf(d.stream, ind, 2, "entry->generation = generation;\n");
+  ind_fprintf(d.stream, ind, 2, "entry->words = words;\n");
+  ind_fprintf(d.stream, ind, 2, "entry->op = op;\n");
+  ind_fprintf(d.stream, ind, 2, "*out = op;\n");
+  ind_fprintf(d.stream, ind, 2, "return words;\n");
+  ind_fprintf(d.stream, ind, 1, "}\n");
+  fprintf(d.stream, "}\n");
+}
+
+// Types and prototypes of the streaming decoder print_stream_decoder() emits.
+// Needs the output of print_fetch_declarations().
+void print_stream_declarations(OpcodenatorData d) {
+  const char *ind = d.indent_string;
+
+  ind_fprintf(d.stream, ind, 0, "#ifndef OPCODE_STREAM_BATCH\n");
+  ind_fprintf(d.stream, ind, 0, "#define OPCODE_STREAM_BATCH 64\n");
+  ind_fprintf(d.stream, ind, 0, "#endif\n");
+  fprintf(d.stream, "\n");
+
+  ind_fprintf(d.stream, ind, 0, "typedef void (*OpcodeHandler)(void *user, "
+      "const DecodedOpcode *op);\n");
+  ind_fprintf(d.stream, ind, 0,
+      "typedef void (*OpcodeBatchHandler)(void *user, "
+      "const DecodedOpcode *ops,\n");
+  ind_fprintf(d.stream, ind, 2, "uint32_t size);\n");
+  fprintf(d.stream, "\n");
+
+  ind_fprintf(d.stream, ind, 0, "// Set batch and/or the handlers of the "
+      "types of interest after\n");
+  ind_fprintf(d.stream, ind, 0, "// opcode_stream_init(), NULL ones are "
+      "skipped. ops only lives until the\n");
+  ind_fprintf(d.stream, ind, 0, "// handlers return.\n");
+  ind_fprintf(d.stream, ind, 0, "typedef struct {\n");
+  ind_fprintf(d.stream, ind, 1, "OpcodeBatchHandler batch;\n");
+  ind_fprintf(d.stream, ind, 1, "OpcodeHandler handlers[INVALID_OP + 1];\n");
+  ind_fprintf(d.stream, ind, 1, "void *user;\n");
+  ind_fprintf(d.stream, ind, 1, "// Bytes of an opcode cut by the end of the "
+      "last buffer.\n");
+  ind_fprintf(d.stream, ind, 1, "uint8_t carry[%u];\n", d.opcode_bits / 8);
+  ind_fprintf(d.stream, ind, 1, "uint32_t carry_size;\n");
+  ind_fprintf(d.stream, ind, 1, "uint32_t size;\n");
+  ind_fprintf(d.stream, ind, 1, "DecodedOpcode ops[OPCODE_STREAM_BATCH];\n");
+  ind_fprintf(d.stream, ind, 0, "} OpcodeStream;\n");
+  fprintf(d.stream, "\n");
+
+  fprintf(d.stream, "void opcode_stream_init(OpcodeStream *stream, "
+      "void *user);\n");
+  fprintf(d.stream, "void opcode_stream_feed(OpcodeStream *stream, "
+      "const uint8_t *buf,\n");
+  ind_fprintf(d.stream, ind, 2, "size_t len);\n");
+  fprintf(d.stream, "void opcode_stream_flush(OpcodeStream *stream);\n");
+  fprintf(d.stream, "uint32_t opcode_stream_finish(OpcodeStream *stream);\n");
+}
+
+// Emits a push style decoder for a stream of opcodes laid out like
+// print_fetch_function() expects, coming in buffers of any size. Opcodes cut
+// by the end of a buffer are completed with the start of the next one. Decoded
+// opcodes are gathered in batches of OPCODE_STREAM_BATCH and handed to the
+// handlers of the OpcodeStream, without allocating or copying the buffers.
+// Needs the output of print_stream_declarations() and print_fetch_function().
+void print_stream_decoder(OpcodenatorData d, uint8_t word_bits) {
+  assert(word_bits % 8 == 0 && "word_bits must be a multiple of 8");
+  assert(d.opcode_bits % word_bits == 0 &&
+      "opcode_bits must be a multiple of word_bits");
+  const char *ind = d.indent_string;
+  uint8_t words = d.opcode_bits / word_bits;
+  uint8_t word_bytes = word_bits / 8;
+
+  fprintf(d.stream, "void opcode_stream_init(OpcodeStream *stream, "
+      "void *user) {\n");
+  ind_fprintf(d.stream, ind, 1, "stream->batch = NULL;\n");
+  ind_fprintf(d.stream, ind, 1, "for (int i = 0; i <= INVALID_OP; i++) {\n");
+  ind_fprintf(d.stream, ind, 2, "stream->handlers[i] = NULL;\n");
+  ind_fprintf(d.stream, ind, 1, "}\n");
+  ind_fprintf(d.stream, ind, 1, "stream->user = user;\n");
+  ind_fprintf(d.stream, ind, 1, "stream->carry_size = 0;\n");
+  ind_fprintf(d.stream, ind, 1, "stream->size = 0;\n");
+  fprintf(d.stream, "}\n");
+  fprintf(d.stream, "\n");
+
+  ind_fprintf(d.stream, ind, 0, "// Hands the batched opcodes to the batch "
+      "handler, then each one to the\n");
+  ind_fprintf(d.stream, ind, 0, "// handler of its type.\n");
+  fprintf(d.stream, "void opcode_stream_flush(OpcodeStream *stream) {\n");
+  ind_fprintf(d.stream, ind, 1, "if (stream->batch != NULL && stream->size > 0)"
+      "\n");
+  ind_fprintf(d.stream, ind, 2, "stream->batch(stream->user, stream->ops, "
+      "stream->size);\n");
+  ind_fprintf(d.stream, ind, 1, "for (uint32_t i = 0; i < stream->size; i++) "
+      "{\n");
+  ind_fprintf(d.stream, ind, 2, "const DecodedOpcode *op = &stream->ops[i];\n");
+  ind_fprintf(d.stream, ind, 2, "if (stream->handlers[op->type] != NULL)\n");
+  ind_fprintf(d.stream, ind, 3, "stream->handlers[op->type](stream->user, "
+      "op);\n");
+  ind_fprintf(d.stream, ind, 1, "}\n");
+  ind_fprintf(d.stream, ind, 1, "stream->size = 0;\n");
+  fprintf(d.stream, "}\n");
+  fprintf(d.stream, "\n");
+
+  ind_fprintf(d.stream, ind, 0, "// Every opcode that's complete by the end "
+      "of buf has been handled when this\n");
+  ind_fprintf(d.stream, ind, 0, "// returns, the bytes of a cut one are kept "
+      "for the next call.\n");
+  fprintf(d.stream, "void opcode_stream_feed(OpcodeStream *stream, "
+      "const uint8_t *buf,\n");
+  ind_fprintf(d.stream, ind, 2, "size_t len) {\n");
+  ind_fprintf(d.stream, ind, 1, "size_t pos = 0;\n");
+  ind_fprintf(d.stream, ind, 1, "if (stream->carry_size > 0) {\n");
+  ind_fprintf(d.stream, ind, 2, "uint32_t carried = stream->carry_size;\n");
+  ind_fprintf(d.stream, ind, 2, "while (stream->carry_size < %u && pos < len) "
+      "{\n", d.opcode_bits / 8);
+  ind_fprintf(d.stream, ind, 3, "stream->carry[stream->carry_size++] = "
+      "buf[pos++];\n");
+  ind_fprintf(d.stream, ind, 2, "}\n");
+  ind_fprintf(d.stream, ind, 2, "uint32_t words = %s_fetch_le(stream->carry,"
+      "\n", d.decode_function_name);
+  ind_fprintf(d.stream, ind, 4, "stream->carry_size / %u, "
+      "&stream->ops[stream->size]);\n", word_bytes);
+  ind_fprintf(d.stream, ind, 2, "if (words == 0)\n");
+  ind_fprintf(d.stream, ind, 3, "return;\n");
+  fprintf(d.stream, "\n");
+  ind_fprintf(d.stream, ind, 2, "stream->size++;\n");
+  ind_fprintf(d.stream, ind, 2, "stream->carry_size = 0;\n");
+  ind_fprintf(d.stream, ind, 2, "pos = words * %u - carried;\n", word_bytes);
+  ind_fprintf(d.stream, ind, 1, "}\n");
+  fprintf(d.stream, "\n");
+  ind_fprintf(d.stream, ind, 1, "for (;;) {\n");
+  ind_fprintf(d.stream, ind, 2, "if (stream->size == OPCODE_STREAM_BATCH)\n");
+  ind_fprintf(d.stream, ind, 3, "opcode_stream_flush(stream);\n");
+  ind_fprintf(d.stream, ind, 2, "size_t left = (len - pos) / %u;\n",
+      word_bytes);
+  ind_fprintf(d.stream, ind, 2, "uint32_t words = %s_fetch_le(buf + pos, "
+      "left < %u ? left : %u,\n", d.decode_function_name, words, words);
+  ind_fprintf(d.stream, ind, 4, "&stream->ops[stream->size]);\n");
+  ind_fprintf(d.stream, ind, 2, "if (words == 0)\n");
+  ind_fprintf(d.stream, ind, 3, "break;\n");
+  fprintf(d.stream, "\n");
+  ind_fprintf(d.stream, ind, 2, "stream->size++;\n");
+  ind_fprintf(d.stream, ind, 2, "pos += words * %u;\n", word_bytes);
+  ind_fprintf(d.stream, ind, 1, "}\n");
+  ind_fprintf(d.stream, ind, 1, "while (pos < len) {\n");
+  ind_fprintf(d.stream, ind, 2, "stream->carry[stream->carry_size++] = "
+      "buf[pos++];\n");
+  ind_fprintf(d.stream, ind, 1, "}\n");
+  ind_fprintf(d.stream, ind, 1, "opcode_stream_flush(stream);\n");
+  fprintf(d.stream, "}\n");
+  fprintf(d.stream, "\n");
+
+  ind_fprintf(d.stream, ind, 0, "// Call at the end of the stream, returns "
+      "how many bytes of a cut opcode\n");
+  ind_fprintf(d.stream, ind, 0, "// were left over and drops them.\n");
+  fprintf(d.stream, "uint32_t opcode_stream_finish(OpcodeStream *stream) {\n");
+  ind_fprintf(d.stream, ind, 1, "uint32_t left = stream->carry_size;\n");
+  ind_fprintf(d.stream, ind, 1, "stream->carry_size = 0;\n");
+  ind_fprintf(d.stream, ind, 1, "return left;\n");
+  fprintf(d.stream, "}\n");
+}
+
+bool metadata_needs_64_bits(OpcodenatorData d) {
+  for (int i = 0; i < d.size; i++) {
+    if (d.opcodes[i].flags > UINT8_MAX)
+      return true;
+  }
+
+  return false;
+}
+
+uint64_t get_metadata(OpcodeData opcode) {
+  if (get_opcode_words(opcode) > 0xF) {
+    fprintf(stderr, "%s is %u words long, metadata only fits 15\n",
+        opcode.enum_str, get_opcode_words(opcode));
+    exit(1);
+  }
+
+  return (uint64_t)opcode.cycles << METADATA_CYCLES_SHIFT |
+    (uint64_t)get_opcode_words(opcode) << METADATA_LENGTH_SHIFT |
+    (uint64_t)opcode.flow << METADATA_FLOW_SHIFT |
+    (uint64_t)opcode.memory << METADATA_MEMORY_SHIFT |
+    (uint64_t)opcode.flags << METADATA_FLAGS_SHIFT;
+}
+
+// The enums used by the metadata, the macros to unpack an entry and the
+// declaration of the table.
+void print_metadata_declaration(OpcodenatorData d) {
+  ind_fprintf(d.stream, d.indent_string, 0, "typedef enum {\n");
+  for (size_t i = 0; i < sizeof(flow_str) / sizeof(flow_str[0]); i++) {
+    ind_fprintf(d.stream, d.indent_string, 1, "%s,\n", flow_str[i]);
+  }
+  ind_fprintf(d.stream, d.indent_string, 0, "} OpcodeFlow;\n");
+  fprintf(d.stream, "\n");
+
+  ind_fprintf(d.stream, d.indent_string, 0, "typedef enum {\n");
+  for (size_t i = 0; i < sizeof(memory_str) / sizeof(memory_str[0]); i++) {
+    ind_fprintf(d.stream, d.indent_string, 1, "%s,\n", memory_str[i]);
+  }
+  ind_fprintf(d.stream, d.indent_string, 0, "} OpcodeMemory;\n");
+  fprintf(d.stream, "\n");
+
+  fprintf(d.stream,
+      "#define OPCODE_META_CYCLES(m) ((uint8_t)((m) >> %u & 0xFF))\n",
+      METADATA_CYCLES_SHIFT);
+  fprintf(d.stream,
+      "#define OPCODE_META_LENGTH(m) ((uint8_t)((m) >> %u & 0xF))\n",
+      METADATA_LENGTH_SHIFT);
+  fprintf(d.stream,
+      "#define OPCODE_META_FLOW(m)   ((OpcodeFlow)((m) >> %u & 0xF))\n",
+      METADATA_FLOW_SHIFT);
+  fprintf(d.stream,
+      "#define OPCODE_META_MEMORY(m) ((OpcodeMemory)((m) >> %u & 0xF))\n",
+      METADATA_MEMORY_SHIFT);
+  fprintf(d.stream,
+      "#define OPCODE_META_FLAGS(m)  ((uint16_t)((m) >> %u & 0xFFFF))\n",
+      METADATA_FLAGS_SHIFT);
+  fprintf(d.stream, "\n");
+  fprintf(d.stream, "extern const %s opcode_metadata[];\n",
+      metadata_needs_64_bits(d) ? "uint64_t" : "uint32_t");
+}
+
+// One packed word per opcode indexed by OpcodeType, so looking up any of the
+// attributes is a single load.
+void print_metadata_definition(OpcodenatorData d) {
+  bool wide = metadata_needs_64_bits(d);
+  int hex_width = wide ? 16 : 8;
+
+  ind_fprintf(d.stream, d.indent_string, 0, "const %s opcode_metadata[] = {\n",
+      wide ? "uint64_t" : "uint32_t");
+  for (int i = 0; i < d.size; i++) {
+    ShortString enum_in_brackets = shortf("[%s]", d.opcodes[i].enum_str);
+    ind_fprintf(d.stream, d.indent_string, 1, "%-*s = 0x%0*lX,\n",
+        d.indent_data.enum_name_width + 2, enum_in_brackets.val,
+        hex_width, get_metadata(d.opcodes[i]));
+  }
+  OpcodeData invalid_op = { .enum_str = "INVALID_OP", .length = 1 };
+  ind_fprintf(d.stream, d.indent_string, 1, "%-*s = 0x%0*lX,\n",
+      d.indent_data.enum_name_width + 2, "[INVALID_OP]",
+      hex_width, get_metadata(invalid_op));
+  ind_fprintf(d.stream, d.indent_string, 0, "};\n");
+}
+
+uint16_t get_opcode_index(OpcodenatorData d, const char *enum_str) {
+  for (uint16_t i = 0; i < d.size; i++) {
+    if (strcmp(d.opcodes[i].enum_str, enum_str) == 0)
+      return i;
+  }
+
+  fprintf(stderr, "unknown opcode: %s\n", enum_str);
+  exit(1);
+}
+
+int compare_pair_keys(const void *a, const void *b) {
+  uint32_t x = *(const uint32_t *)a;
+  uint32_t y = *(const uint32_t *)b;
+  return (x > y) - (x < y);
+}
+
+// Counts every pair of consecutive opcodes in the trace. output needs room for
+// n - 1 pairs, returns how many unique pairs were found.
+uint32_t get_pairs_from_trace(const uint16_t *trace, size_t n,
+    OpcodePair *output) {
+  if (n < 2)
+    return 0;
+
+  uint32_t *keys = malloc((n - 1) * sizeof(uint32_t));
+  assert(keys != NULL);
+  for (size_t i = 0; i < n - 1; i++) {
+    keys[i] = (uint32_t)trace[i] << 16 | trace[i + 1];
+  }
+  qsort(keys, n - 1, sizeof(uint32_t), compare_pair_keys);
+
+  uint32_t count = 0;
+  for (size_t i = 0; i < n - 1; i++) {
+    if (count > 0 && keys[i] == keys[i - 1]) {
+      output[count - 1].count++;
+      continue;
+    }
+
+    output[count++] = (OpcodePair) {
+      .first = keys[i] >> 16,
+      .second = keys[i] & 0xFFFF,
+      .count = 1,
+    };
+  }
+
+  free(keys);
+  return count;
+}
+
+// Most frequent first, ties by first then second opcode so the same counts
+// always give the same order.
+int compare_pair_counts(const void *a, const void *b) {
+  const OpcodePair *x = a;
+  const OpcodePair *y = b;
+  if (x->count != y->count)
+    return (x->count < y->count) - (x->count > y->count);
+  if (x->first != y->first)
+    return (x->first > y->first) - (x->first < y->first);
+  return (x->second > y->second) - (x->second < y->second);
+}
+
+// Drops the pairs with an INVALID_OP (d.size) in them, which a trace has
+// wherever it ran into something that doesn't decode, and the ones seen less
+// than min_count times. Sorts the rest from most to least frequent and returns
+// how many of them should be fused, at most max_pairs.
+uint32_t get_hot_pairs(OpcodenatorData d, OpcodePair *pairs, uint32_t n,
+    uint32_t max_pairs, uint32_t min_count) {
+  bool have_duplicate = false;
+
+  uint32_t valid = 0;
+  for (uint32_t i = 0; i < n; i++) {
+    assert(pairs[i].first <= d.size && pairs[i].second <= d.size);
+    if (pairs[i].first < d.size && pairs[i].second < d.size &&
+        pairs[i].count >= min_count)
+      pairs[valid++] = pairs[i];
+  }
+  n = valid;
+
+  for (uint32_t i = 0; i < n; i++) {
+    for (uint32_t j = i + 1; j < n; j++) {
+      if (pairs[i].first == pairs[j].first &&
+          pairs[i].second == pairs[j].second) {
+        fprintf(stderr, "duplicate pair detected: %s %s\n",
+            d.opcodes[pairs[i].first].enum_str,
+            d.opcodes[pairs[i].second].enum_str);
+        have_duplicate = true;
+      }
+    }
+  }
+
+  if (have_duplicate) {
+    fprintf(stderr, "exiting with errors\n");
+    exit(1);
+  }
+
+  qsort(pairs, n, sizeof(OpcodePair), compare_pair_counts);
+  return n < max_pairs ? n : max_pairs;
+}
+
+ShortString get_fused_name(OpcodenatorData d, OpcodePair pair) {
+  return shortf("%s_%s", d.opcodes[pair.first].enum_str,
+      d.opcodes[pair.second].enum_str);
+}
+
+ShortString get_fused_function_name(OpcodenatorData d, OpcodePair pair) {
+  ShortString function_name = shortf("%sfused_%s", d.function_prefix,
+      get_fused_name(d, pair).val);
+  for (int i = 0; i < function_name.len; i++) {
+    function_name.val[i] = tolower(function_name.val[i]);
+  }
+
+  return function_name;
+}
+
+void print_fused_enum_declaration(OpcodenatorData d, const OpcodePair *pairs,
+    uint32_t n) {
+  ind_fprintf(d.stream, d.indent_string, 0,
+      "typedef enum __attribute__ ((packed)) {\n");
+  for (uint32_t i = 0; i < n; i++) {
+    ind_fprintf(d.stream, d.indent_string, 1, "FUSED_%s,\n",
+        get_fused_name(d, pairs[i]).val);
+  }
+  ind_fprintf(d.stream, d.indent_string, 1, "%s,\n", "NOT_FUSED");
+  ind_fprintf(d.stream, d.indent_string, 0, "} FusedOpcodeType;\n");
+}
+
+// A fused handler gets both opcodes and runs them back to back.
+void print_fused_struct_declaration(OpcodenatorData d) {
+  ind_fprintf(d.stream, d.indent_string, 0, "typedef struct {\n");
+  ind_fprintf(d.stream, d.indent_string, 1, "char name[%u];\n",
+      MAX_ENUM_STR * 2);
+  ind_fprintf(d.stream, d.indent_string, 1, "void (*function)(%s, %s);\n",
+      get_opcode_type_str(d.opcode_bits), get_opcode_type_str(d.opcode_bits));
+  ind_fprintf(d.stream, d.indent_string, 0, "} FusedOpcodeData;\n");
+}
+
+void print_fused_function_declarations(OpcodenatorData d,
+    const OpcodePair *pairs, uint32_t n) {
+  for (uint32_t i = 0; i < n; i++) {
+    fprintf(d.stream, "void %s(%s first, %s second);\n",
+        get_fused_function_name(d, pairs[i]).val,
+        get_opcode_type_str(d.opcode_bits),
+        get_opcode_type_str(d.opcode_bits));
+  }
+}
+
+void print_fused_empty_function_definitions(OpcodenatorData d,
+    const OpcodePair *pairs, uint32_t n) {
+  for (uint32_t i = 0; i < n; i++) {
+    fprintf(d.stream, "void %s(%s, %s) { }\n",
+        get_fused_function_name(d, pairs[i]).val,
+        get_opcode_type_str(d.opcode_bits),
+        get_opcode_type_str(d.opcode_bits));
+  }
+}
+
+void print_fused_array_definition(OpcodenatorData d, const OpcodePair *pairs,
+    uint32_t n) {
+  int name_width = 0;
+  for (uint32_t i = 0; i < n; i++) {
+    if (name_width < get_fused_name(d, pairs[i]).len)
+      name_width = get_fused_name(d, pairs[i]).len;
+  }
+  int function_name_width = name_width + strlen(d.function_prefix) +
+    strlen("fused_");
+
+  ind_fprintf(d.stream, d.indent_string, 0,
+      "FusedOpcodeData fused_opcodes[] = {\n");
+  for (uint32_t i = 0; i < n; i++) {
+    ShortString fused_name = get_fused_name(d, pairs[i]);
+    ShortString enum_in_brackets = shortf("[FUSED_%s]", fused_name.val);
+    ShortString enum_in_quotes = shortf("\"%s\",", fused_name.val);
+    ind_fprintf(d.stream, d.indent_string, 1,
+        "%-*s = { .name = %-*s .function = %-*s },\n",
+        name_width + 8, enum_in_brackets.val,
+        name_width + 3, enum_in_quotes.val,
+        function_name_width, get_fused_function_name(d, pairs[i]).val);
+  }
+  ind_fprintf(d.stream, d.indent_string, 0, "};\n");
+}
+
+void print_fused_decoder_declaration(OpcodenatorData d) {
+  fprintf(d.stream, "extern FusedOpcodeData fused_opcodes[];\n");
+  fprintf(d.stream,
+      "FusedOpcodeType %s_fused(OpcodeType first, OpcodeType second);\n",
+      d.decode_function_name);
+}
+
+// Maps two already decoded opcodes to their fused entry, so an interpreter
+// that predecodes can dispatch once for the whole pair. It doesn't decode the
+// pair from the opcode words, both opcodes have to be decoded first and only
+// the dispatch is shared.
+void print_fused_decoder_function(OpcodenatorData d, const OpcodePair *pairs,
+    uint32_t n) {
+  fprintf(d.stream,
+      "FusedOpcodeType %s_fused(OpcodeType first, OpcodeType second) {\n",
+      d.decode_function_name);
+  ind_fprintf(d.stream, d.indent_string, 1, "switch (first) {\n");
+
+  for (uint32_t i = 0; i < n; i++) {
+    bool first_seen = false;
+    for (uint32_t j = 0; j < i; j++) {
+      if (pairs[j].first == pairs[i].first) {
+        first_seen = true;
+        break;
+      }
+    }
+
+    if (first_seen)
+      continue;
+
+    ind_fprintf(d.stream, d.indent_string, 1, "case %s: {\n",
+        d.opcodes[pairs[i].first].enum_str);
+    ind_fprintf(d.stream, d.indent_string, 2, "switch (second) {\n");
+    for (uint32_t j = i; j < n; j++) {
+      if (pairs[j].first != pairs[i].first)
+        continue;
+
+      ind_fprintf(d.stream, d.indent_string, 2, "case %s:\n",
+          d.opcodes[pairs[j].second].enum_str);
+      ind_fprintf(d.stream, d.indent_string, 3, "return FUSED_%s;\n",
+          get_fused_name(d, pairs[j]).val);
+    }
+    ind_fprintf(d.stream, d.indent_string, 2, "default:\n");
+    ind_fprintf(d.stream, d.indent_string, 3, "break;\n");
+    ind_fprintf(d.stream, d.indent_string, 2, "}\n");
+    ind_fprintf(d.stream, d.indent_string, 2, "} break;\n");
+  }
+
+  ind_fprintf(d.stream, d.indent_string, 1, "default:\n");
+  ind_fprintf(d.stream, d.indent_string, 2, "break;\n");
+  ind_fprintf(d.stream, d.indent_string, 1, "}\n");
+  ind_fprintf(d.stream, d.indent_string, 1, "return NOT_FUSED;\n");
+  fprintf(d.stream, "}\n");
+}
+
+// Opcodes wider than 64 bits are passed around as a vector of two lanes, least
+// significant lane first, so the leaves of the decoder can check them with a
+// single 128 bit operation.
+void print_includes(OpcodenatorData d) {
+  fprintf(d.stream, "#include <stddef.h>\n");
+  fprintf(d.stream, "#include <stdint.h>\n");
+  if (d.opcode_bits > 64) {
+    fprintf(d.stream, "\n");
+    fprintf(d.stream,
+        "typedef uint64_t OpcodeWide __attribute__ ((vector_size (16)));\n");
+  }
 }
 
 #endif // OPCODENATOR_IMPLEMENTATION